@@ -0,0 +1,112 @@
+#!/bin/sh
+#
+# Renderer benchmark: generates each scene with scenegen, renders it with
+# "pbmpgfx -v" and reports the best parse, render and encode times of
+# BENCH_RUNS runs, then compares them with a stored baseline.
+#
+# Usage: run.sh PBMPGFX SCENEGEN BASELINE [--update]
+#
+# --update writes the measured times to BASELINE instead of comparing.
+# Exits with 1 if any phase is more than BENCH_TOLERANCE times slower than
+# its baseline. Phases that took less than BENCH_MIN_MS in the baseline are
+# too noisy to judge and are only reported.
+#
+# Environment: BENCH_SIZE   canvas width and height (default 2000)
+#              BENCH_RUNS   runs per scene, best is kept (default 3)
+#              BENCH_TOLERANCE  allowed slowdown factor (default 1.25)
+#              BENCH_MIN_MS shortest baseline time checked (default 20)
+#              BENCH_FORMAT output format (default p3)
+#              BENCH_SCENES scenes to run (default all)
+
+if [ $# -lt 3 ]; then
+	echo "Usage: $0 PBMPGFX SCENEGEN BASELINE [--update]" >&2
+	exit 1
+fi
+
+pbmpgfx=$1
+scenegen=$2
+baseline=$3
+update=${4:-}
+
+size=${BENCH_SIZE:-2000}
+runs=${BENCH_RUNS:-3}
+tolerance=${BENCH_TOLERANCE:-1.25}
+min_ms=${BENCH_MIN_MS:-20}
+format=${BENCH_FORMAT:-p3}
+scenes=${BENCH_SCENES:-"points lines rects circles ellipses filled maze mixed"}
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT INT TERM
+
+: > "$tmp/results"
+for scene in $scenes; do
+	"$scenegen" "$scene" "$size" "$size" > "$tmp/scene.txt" || exit 1
+
+	: > "$tmp/times"
+	i=0
+	while [ $i -lt "$runs" ]; do
+		"$pbmpgfx" -v -f "$format" < "$tmp/scene.txt" 2>> "$tmp/times" \
+			> /dev/null
+		i=$((i + 1))
+	done
+
+	# keep the best time of each phase
+	awk -v scene="$scene" -v px="$size" '
+		$1 == "parse:"  { n = $4; t = $7; if (!p || t < p) p = t }
+		$1 == "render:" { t = $5; if (!r || t < r) r = t }
+		$1 == "encode:" { t = $5; if (!e || t < e) e = t }
+		END { printf "%s %d %.3f %.3f %.3f\n", scene, n, p, r, e }
+	' "$tmp/times" >> "$tmp/results"
+done
+
+if [ "$update" = "--update" ]; then
+	{
+		echo "# scene commands parse_ms render_ms encode_ms"
+		echo "# BENCH_SIZE=$size BENCH_FORMAT=$format"
+		cat "$tmp/results"
+	} > "$baseline"
+	echo "Baseline written to $baseline"
+	cat "$tmp/results"
+	exit 0
+fi
+
+if [ ! -f "$baseline" ]; then
+	echo "No baseline at $baseline (create one with --update)" >&2
+	baseline=/dev/null
+fi
+awk -v tol="$tolerance" -v min_ms="$min_ms" -v px="$size" \
+		-v basefile="$baseline" '
+	FILENAME == basefile {
+		if ($1 !~ /^#/)
+			base[$1] = $3 " " $4 " " $5
+		next
+	}
+	function rate(n, ms) { return ms > 0 ? n / (ms / 1000) : 0 }
+	function cmp(t, b) {
+		if (b <= 0)
+			return "     -"
+		if (t > b * tol && b >= min_ms) {
+			slow = 1
+			return sprintf("%5.2fx!", t / b)
+		}
+		return sprintf("%5.2fx ", t / b)
+	}
+	BEGIN {
+		printf "%-9s %9s %9s %9s %9s %10s %10s %9s  vs baseline\n",
+			"scene", "commands", "parse ms", "render ms", "encode ms",
+			"parse c/s", "render c/s", "Mpx/s"
+	}
+	{
+		split(base[$1], b, " ")
+		printf "%-9s %9d %9.1f %9.1f %9.1f %10.3g %10.3g %9.1f  %s %s %s\n",
+			$1, $2, $3, $4, $5, rate($2, $3), rate($2, $4),
+			rate(px * px, $4) / 1e6,
+			cmp($3, b[1]), cmp($4, b[2]), cmp($5, b[3])
+	}
+	END {
+		if (slow)
+			print "\nRegression: some phases are more than " tol \
+				"x slower than the baseline (marked !)"
+		exit slow
+	}
+' "$baseline" "$tmp/results"
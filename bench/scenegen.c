@@ -0,0 +1,319 @@
+/* Deterministic scene generator for the renderer benchmarks.
+ *
+ * Usage: scenegen KIND WIDTH HEIGHT [COUNT [SEED]]
+ *
+ * Writes a script of COUNT commands of the given KIND to stdout. The same
+ * arguments always produce the same script, on any platform.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+struct scene_def {
+	const char *name;
+	void (*gen)(FILE *fpo, int w, int h, long count);
+	long default_count;
+	const char *desc;
+};
+
+/***************************************************************************/
+
+static void gen_points(FILE *fpo, int w, int h, long count);
+static void gen_lines(FILE *fpo, int w, int h, long count);
+static void gen_rects(FILE *fpo, int w, int h, long count);
+static void gen_circles(FILE *fpo, int w, int h, long count);
+static void gen_ellipses(FILE *fpo, int w, int h, long count);
+static void gen_filled(FILE *fpo, int w, int h, long count);
+static void gen_maze(FILE *fpo, int w, int h, long count);
+static void gen_mixed(FILE *fpo, int w, int h, long count);
+
+static uint32_t rnd(void);
+static int rnd_range(int lo, int hi);
+static void put_colour(FILE *fpo);
+static void usage(const char *progname);
+
+static uint64_t rng_state;
+
+static const struct scene_def scenes[] = {
+	{ "points",   gen_points,   1000000, "single pixels" },
+	{ "lines",    gen_lines,    100000,  "line storm, some off-canvas" },
+	{ "rects",    gen_rects,    20000,   "overlapping rectangles" },
+	{ "circles",  gen_circles,  2000,    "big circle outlines" },
+	{ "ellipses", gen_ellipses, 2000,    "big ellipse outlines" },
+	{ "filled",   gen_filled,   2000,    "fcircle and fellipse" },
+	{ "maze",     gen_maze,     20,      "flood fills of a maze" },
+	{ "mixed",    gen_mixed,    50000,   "all primitives" },
+	{ NULL, NULL, 0, NULL }
+};
+
+/***************************************************************************/
+
+int main(int argc, char **argv)
+{
+	const struct scene_def *def;
+	long count;
+	int w, h;
+
+	if (argc < 4 || argc > 6) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (def = scenes; def->name; def++)
+		if (strcmp(def->name, argv[1]) == 0)
+			break;
+	w = atoi(argv[2]);
+	h = atoi(argv[3]);
+	if (def->name == NULL || w <= 0 || h <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	count = argc > 4 ? atol(argv[4]) : def->default_count;
+	rng_state = argc > 5 ? strtoull(argv[5], NULL, 10) : 1;
+
+	printf("%d %d\n", w, h);
+	def->gen(stdout, w, h, count);
+
+	return fflush(stdout) != 0;
+}
+
+static void usage(const char *progname)
+{
+	const struct scene_def *def;
+
+	fprintf(stderr, "Usage: %s KIND WIDTH HEIGHT [COUNT [SEED]]\n\n"
+			"Kinds (default COUNT):\n", progname);
+	for (def = scenes; def->name; def++)
+		fprintf(stderr, "  %-9s %-30s (%ld)\n", def->name, def->desc,
+				def->default_count);
+}
+
+
+/***************************************************************************
+ * Scenes
+ ***************************************************************************/
+
+static void gen_points(FILE *fpo, int w, int h, long count)
+{
+	while (count--) {
+		fputs("point ", fpo);
+		put_colour(fpo);
+		fprintf(fpo, " %d %d\n", rnd_range(0, h - 1), rnd_range(0, w - 1));
+	}
+}
+
+/* Mostly on-canvas lines of all slopes; one in eight lies entirely off the
+ * canvas or crosses it from far away, to exercise clipping.
+ */
+static void gen_lines(FILE *fpo, int w, int h, long count)
+{
+	while (count--) {
+		int far = rnd() % 8 == 0;
+
+		fputs("line ", fpo);
+		put_colour(fpo);
+		if (far)
+			fprintf(fpo, " %d %d %d %d\n",
+					rnd_range(-4 * h, 5 * h), rnd_range(-4 * w, 5 * w),
+					rnd_range(-4 * h, 5 * h), rnd_range(-4 * w, 5 * w));
+		else
+			fprintf(fpo, " %d %d %d %d\n",
+					rnd_range(0, h - 1), rnd_range(0, w - 1),
+					rnd_range(0, h - 1), rnd_range(0, w - 1));
+	}
+}
+
+static void gen_rects(FILE *fpo, int w, int h, long count)
+{
+	while (count--) {
+		fputs("rect ", fpo);
+		put_colour(fpo);
+		fprintf(fpo, " %d %d %d %d\n",
+				rnd_range(-h / 8, h - 1), rnd_range(-w / 8, w - 1),
+				rnd_range(1, h / 2), rnd_range(1, w / 2));
+	}
+}
+
+static void gen_circles(FILE *fpo, int w, int h, long count)
+{
+	int rmax = (w > h ? w : h);
+
+	while (count--) {
+		fputs("circle ", fpo);
+		put_colour(fpo);
+		fprintf(fpo, " %d %d %d\n", rnd_range(0, h - 1),
+				rnd_range(0, w - 1), rnd_range(rmax / 8, rmax));
+	}
+}
+
+static void gen_ellipses(FILE *fpo, int w, int h, long count)
+{
+	while (count--) {
+		fputs("ellipse ", fpo);
+		put_colour(fpo);
+		fprintf(fpo, " %d %d %d %d\n", rnd_range(0, h - 1),
+				rnd_range(0, w - 1), rnd_range(h / 16, h),
+				rnd_range(w / 16, w));
+	}
+}
+
+static void gen_filled(FILE *fpo, int w, int h, long count)
+{
+	int rmax = (w < h ? w : h) / 4;
+
+	while (count--) {
+		if (rnd() & 1) {
+			fputs("fcircle ", fpo);
+			put_colour(fpo);
+			fprintf(fpo, " %d %d %d\n", rnd_range(0, h - 1),
+					rnd_range(0, w - 1), rnd_range(1, rmax));
+		} else {
+			fputs("fellipse ", fpo);
+			put_colour(fpo);
+			fprintf(fpo, " %d %d %d %d\n", rnd_range(0, h - 1),
+					rnd_range(0, w - 1), rnd_range(1, rmax),
+					rnd_range(1, rmax));
+		}
+	}
+}
+
+/* A perfect maze with 8 pixel corridors (randomized depth-first search),
+ * drawn as wall lines and then flooded 'count' times from a corner with
+ * alternating colours. Every fill covers the whole maze and the corridors
+ * turn often, which is the worst case for span fills.
+ */
+static void gen_maze(FILE *fpo, int w, int h, long count)
+{
+	const int cell = 8;
+	int cw = (w - 1) / cell, ch = (h - 1) / cell;
+	unsigned char *walls;		/* bit 0: east wall, bit 1: south wall */
+	int *stack, sp = 0, x, y, i;
+
+	if (cw < 1 || ch < 1)
+		return;
+	walls = malloc((size_t)cw * ch);
+	stack = malloc((size_t)cw * ch * sizeof *stack);
+	if (!walls || !stack) {
+		fputs("ERROR: Could not allocate memory for the maze\n", stderr);
+		free(walls);
+		free(stack);
+		return;
+	}
+	memset(walls, 3 | 4, (size_t)cw * ch);	/* bit 2: not visited */
+
+	walls[0] &= ~4;
+	stack[sp++] = 0;
+	while (sp > 0) {
+		int c = stack[sp - 1], next[4], n = 0;
+
+		x = c % cw;
+		y = c / cw;
+		if (x > 0 && walls[c - 1] & 4)
+			next[n++] = c - 1;
+		if (x < cw - 1 && walls[c + 1] & 4)
+			next[n++] = c + 1;
+		if (y > 0 && walls[c - cw] & 4)
+			next[n++] = c - cw;
+		if (y < ch - 1 && walls[c + cw] & 4)
+			next[n++] = c + cw;
+		if (n == 0) {
+			sp--;
+			continue;
+		}
+
+		i = next[rnd() % n];
+		if (i == c - 1)
+			walls[i] &= ~1;
+		else if (i == c + 1)
+			walls[c] &= ~1;
+		else if (i == c - cw)
+			walls[i] &= ~2;
+		else
+			walls[c] &= ~2;
+		walls[i] &= ~4;
+		stack[sp++] = i;
+	}
+
+	fprintf(fpo, "line 255 255 255 0 0 0 %d\n", cw * cell);
+	fprintf(fpo, "line 255 255 255 0 0 %d 0\n", ch * cell);
+	for (y = 0; y < ch; y++) {
+		for (x = 0; x < cw; x++) {
+			int r = (y + 1) * cell, c = (x + 1) * cell;
+
+			if (walls[y * cw + x] & 1)
+				fprintf(fpo, "line 255 255 255 %d %d %d %d\n",
+						r - cell, c, r, c);
+			if (walls[y * cw + x] & 2)
+				fprintf(fpo, "line 255 255 255 %d %d %d %d\n",
+						r, c - cell, r, c);
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		fprintf(fpo, "fill %d %d %d 1 1\n", i & 1 ? 40 : 200, 80, i & 1
+				? 200 : 40);
+
+	free(walls);
+	free(stack);
+}
+
+static void gen_mixed(FILE *fpo, int w, int h, long count)
+{
+	while (count > 0) {
+		switch (rnd() % 16) {
+		case 0:
+			gen_rects(fpo, w, h, 1);
+			break;
+		case 1:
+			gen_circles(fpo, w, h, 1);
+			break;
+		case 2:
+			gen_ellipses(fpo, w, h, 1);
+			break;
+		case 3:
+			gen_filled(fpo, w, h, 1);
+			break;
+		case 4:
+		case 5:
+		case 6:
+			gen_lines(fpo, w, h, 1);
+			break;
+		default:
+			gen_points(fpo, w, h, 1);
+			break;
+		}
+		count--;
+	}
+}
+
+
+/***************************************************************************
+ * Misc
+ ***************************************************************************/
+
+/* splitmix64, truncated to 32 bits */
+static uint32_t rnd(void)
+{
+	uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (uint32_t)((z ^ (z >> 31)) >> 32);
+}
+
+/* Returns a number in [lo, hi]; lo if the range is empty */
+static int rnd_range(int lo, int hi)
+{
+	if (hi <= lo)
+		return lo;
+	return lo + (int)(rnd() % ((uint32_t)(hi - lo) + 1));
+}
+
+static void put_colour(FILE *fpo)
+{
+	uint32_t c = rnd();
+
+	fprintf(fpo, "%u %u %u", c & 0xff, (c >> 8) & 0xff, (c >> 16) & 0xff);
+}
@@ -3,74 +3,143 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pbmpgfx.h"
 
 #define GAMMA 2.2
 
-struct bitmap {
-	int w, h;
-	uint32_t *data;
-};
+/* Gaussian blur: default and largest standard deviation in pixels, and
+ * the kernel radius used for a given one. Past BLUR_SIGMA_MAX the outer
+ * taps of the 14 bit kernel round to 0.
+ */
+#define BLUR_SIGMA         1.4
+#define BLUR_SIGMA_MAX     50
+#define BLUR_RADIUS(sigma) ((int)ceil(3 * (sigma)))
 
-struct rgb255 {
-	int r, g, b;
-};
+/* Edge detector: greyscale, gaussian blur and Sobel gradient of a PPM image,
+ * or with -r of a pbmpgfx script rendered in-process by libpbmpgfx, so the
+ * canvas goes straight into the filters without a PPM round-trip.
+ */
 
-struct point2d {
-	int x, y;
+/* The whole input image, either mmap()ed or read into memory */
+struct ppm_input {
+	const unsigned char *data;
+	size_t len;
+	size_t map_len;		/* non-zero if 'data' is a mapping */
 };
 
-uint32_t fromRGB(const struct rgb255 *c);
 uint32_t fromRGB_components(uint8_t r, uint8_t g, uint8_t b);
-void toRGB(uint32_t c, struct rgb255 *dest);
 uint32_t toGrey(uint32_t c);
 uint8_t toGrey_8(uint32_t c);
 uint8_t toGrey_8_gamma(uint32_t c, double gamma);
 
-
-struct bitmap *bitmap_new(int w, int h);
-void bitmap_destroy(struct bitmap *bmap);
 struct bitmap *bitmap_clone(const struct bitmap *bmap);
 struct bitmap *bitmap_edge_sobel(const struct bitmap *bmap);
-struct bitmap *bitmap_gaussblur(struct bitmap *bmap, int replace);
+struct bitmap *bitmap_gaussblur(struct bitmap *bmap, double sigma,
+		int replace);
 void bitmap_togrey(struct bitmap *bmap);
 void bitmap_togrey_gamma(struct bitmap *bmap, double gamma);
 void bitmap_getregion(const struct bitmap *bmap,
 		int region_x, int region_y, int region_w, int region_h,
 		uint32_t colour_mask, uint32_t *dest);
-void bitmap_setpixel(const struct bitmap *bmap, uint32_t c,
-		int x, int y);
-uint32_t bitmap_getpixel(const struct bitmap *bmap, int x, int y);
 
 struct bitmap *bitmap_load_ppm(FILE *fp);
 void bitmap_save_ppm(FILE *fpo, const struct bitmap *bmap);
 
-char *get_line(FILE *fp, char *buff, size_t sz, size_t *linenum);
-const char *skip_leading_spaces(const char *s);
+int input_load(FILE *fp, struct ppm_input *in);
+void input_release(struct ppm_input *in);
+void usage(const char *progname);
 
 /***************************************************************************
  * "Private" functions
  ***************************************************************************/
 
 static int sobel_getgradient(const uint32_t region[9], int horiz);
+static int ppm_header_int(const unsigned char **p, const unsigned char *end,
+		unsigned long *v);
+static size_t ppm_read_p3(const unsigned char *p, const unsigned char *end,
+		const uint8_t *scale, unsigned long maxval, uint32_t *dest,
+		size_t n);
+static size_t ppm_read_p6(const unsigned char *p, const unsigned char *end,
+		const uint8_t *scale, unsigned long maxval, uint32_t *dest,
+		size_t n);
+static int16_t *blur_kernel(double sigma, int radius);
+static void blur_taps(const int16_t *const *src, const int16_t *w, int taps,
+		int shift, int16_t *dest, int n);
 
 /***************************************************************************/
 
-int main(void)
+int main(int argc, char **argv)
 {
+	static const struct option longopts[] = {
+		{ "render",  no_argument,       NULL, 'r' },
+		{ "format",  required_argument, NULL, 'f' },
+		{ "sigma",   required_argument, NULL, 's' },
+		{ "help",    no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
 	struct bitmap *bmap, *edges;
+	enum image_format format = IMG_P3;
+	double sigma = BLUR_SIGMA;
+	char *end;
+	int render = 0;
+	int ch;
+
+	while ((ch = getopt_long(argc, argv, "rf:s:h", longopts, NULL)) != -1) {
+		switch (ch) {
+		case 'r':
+			render = 1;
+			break;
+		case 'f':
+			if (!parse_image_format(optarg, &format)) {
+				fprintf(stderr, "Unknown output format \"%s\"\n", optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			sigma = strtod(optarg, &end);
+			if (end == optarg || *end != '\0'
+					|| !(sigma >= 0 && sigma <= BLUR_SIGMA_MAX)) {
+				fprintf(stderr, "Bad blur sigma \"%s\"\n", optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (render)
+		bmap = script_render_file(stdin, NULL);
+	else
+		bmap = bitmap_load_ppm(stdin);
 
-	if ((bmap = bitmap_load_ppm(stdin))) {
+	if (bmap) {
 		//bitmap_togrey_gamma(bmap, GAMMA);
 		bitmap_togrey(bmap);
 
 #if 0
-		bitmap_gaussblur(bmap, 1);
+		bitmap_gaussblur(bmap, sigma, 1);
 		bitmap_save_ppm(stdout, bmap);
 #else
-		bitmap_gaussblur(bmap, 1);
+		bitmap_gaussblur(bmap, sigma, 1);
 		if ((edges = bitmap_edge_sobel(bmap))) {
-			bitmap_save_ppm(stdout, edges);
+			bitmap_to_pbmp(stdout, edges, format);
 			bitmap_destroy(edges);
 		}
 #endif
@@ -83,36 +152,23 @@ int main(void)
 	return 0;
 }
 
-/***************************************************************************
- * "Bitmap"
- ***************************************************************************/
-
-struct bitmap *bitmap_new(int w, int h)
+void usage(const char *progname)
 {
-	struct bitmap *bmap;
-
-	if (w <= 0 || h <= 0)
-		return NULL;
-
-	if (!(bmap = malloc(sizeof *bmap)))
-		return NULL;
-
-	if (!(bmap->data = calloc(w * h, sizeof *bmap->data))) {
-		free(bmap);
-		return NULL;
-	}
-
-	bmap->w = w;
-	bmap->h = h;
-
-	return bmap;
+	fprintf(stderr,
+		"Usage: %s [-r] [-f p3|p6|pam] [-s sigma] < input > output\n"
+		"  -r, --render       the input is a pbmpgfx script or display list\n"
+		"                     instead of a PPM image; it is rendered and its\n"
+		"                     canvas filtered in memory\n"
+		"  -f, --format FMT   output format: p3 (ASCII, default), p6 (binary)\n"
+		"                     or pam (binary, P7 RGB)\n"
+		"  -s, --sigma SIGMA  standard deviation of the gaussian blur in\n"
+		"                     pixels (default %.1f, 0: no blur, at most %d)\n",
+		progname, BLUR_SIGMA, BLUR_SIGMA_MAX);
 }
 
-void bitmap_destroy(struct bitmap *bmap)
-{
-	free(bmap->data);
-	free(bmap);
-}
+/***************************************************************************
+ * "Bitmap"
+ ***************************************************************************/
 
 struct bitmap *bitmap_clone(const struct bitmap *bmap)
 {
@@ -160,56 +216,94 @@ struct bitmap *bitmap_edge_sobel(const struct bitmap *bmap)
 
 }
 
-/* if 'replace' != 0 then the values of 'bmap' are replaced with the result,
+/* Blurs the grey image 'bmap' (its blue channel) with a gaussian of
+ * standard deviation 'sigma', clamping at the borders.
+ *
+ * if 'replace' != 0 then the values of 'bmap' are replaced with the result,
  * otherwise 'bmap' is not changed and a version of the blurred bmap is
  * returned; if replace == 0 then the caller is responsible for deallocating
  * resources.
+ *
+ * The kernel is separable: each row is blurred horizontally as it is
+ * needed and kept in a ring of 2 * radius + 1 rows, from which the
+ * vertical pass writes the output row. Weights are 14 bit fixed point and
+ * the horizontal results keep 7 fractional bits. Output rows are written
+ * only after the last row that reads them has been blurred horizontally,
+ * so 'bmap' can be replaced without a second image.
  */
-struct bitmap *bitmap_gaussblur(struct bitmap *bmap, int replace)
+struct bitmap *bitmap_gaussblur(struct bitmap *bmap, double sigma,
+		int replace)
 {
-	static const int K[5*5] = { /* The guassian convolution matrix */
-		2,  4,  5,  4, 2,
-		4,  9, 12,  9, 4,
-		5, 12, 15, 12, 5,
-		4,  9, 12,  9, 4,
-		2,  4,  5,  4, 2
-	};
-	static const int divisor = 159;
-
-	int x, y;
-	size_t i;
-	uint32_t region[5*5];
-
+	int radius = sigma > 0 ? BLUR_RADIUS(sigma) : 0;
+	int taps = 2 * radius + 1;
+	int x, y, k, next;
+	int16_t *w, *ring = NULL, *pad = NULL, *out = NULL;
+	const int16_t **src = NULL;
 	struct bitmap *dest;
 
-	if (!(dest = bitmap_new(bmap->w, bmap->h)))
+	if (replace)
+		dest = bmap;
+	else if (!(dest = bitmap_new(bmap->w, bmap->h)))
 		return NULL;
+	if (bmap->w == 0 || bmap->h == 0)
+		return dest;		/* no pixels, and no border to pad from */
+
+	if (!(w = blur_kernel(sigma, radius))
+			|| !(ring = malloc((size_t)taps * bmap->w * sizeof *ring))
+			|| !(pad = malloc(((size_t)bmap->w + 2 * radius) * sizeof *pad))
+			|| !(out = malloc((size_t)bmap->w * sizeof *out))
+			|| !(src = malloc(((size_t)taps + 1) * sizeof *src))) {
+		fputs("ERROR: (blur) Could not alloc memory for rows\n", stderr);
+		free(w);
+		free(ring);
+		free(pad);
+		free(out);
+		if (!replace)
+			bitmap_destroy(dest);
+		return NULL;
+	}
 
+	/* row 'next' is the next one to blur horizontally, into ring slot
+	 * next % taps
+	 */
+	next = 0;
 	for (y = 0; y < bmap->h; y++) {
-		for (x = 0; x < bmap->w; x++) {
-			double v = 0;
-			struct rgb255 rgb;
-
-			bitmap_getregion(bmap, x, y, 5, 5, 0xff, region);
-			for (i = 0; i < sizeof K / sizeof *K; i++) {
-				v += K[i] * region[i];
-			}
-			v /= divisor;
+		uint32_t *row;
+
+		for ( ; next < bmap->h && next <= y + radius; next++) {
+			row = bmap->data + (size_t)next * bmap->w;
+			for (x = 0; x < radius; x++)
+				pad[x] = row[0] & 0xff;
+			for (x = 0; x < bmap->w; x++)
+				pad[radius + x] = row[x] & 0xff;
+			for (x = 0; x < radius; x++)
+				pad[radius + bmap->w + x] = row[bmap->w - 1] & 0xff;
+
+			for (k = 0; k < taps; k++)
+				src[k] = pad + k;
+			blur_taps(src, w, taps, 7, ring + (size_t)(next % taps) * bmap->w,
+					bmap->w);
+		}
 
-			rgb.r = rgb.g = rgb.b = v;
+		for (k = 0; k < taps; k++) {
+			int sy = y - radius + k;
 
-			bitmap_setpixel(dest, fromRGB(&rgb), x, y);
+			sy = sy < 0 ? 0 : sy < bmap->h ? sy : bmap->h - 1;
+			src[k] = ring + (size_t)(sy % taps) * bmap->w;
 		}
-	}
-
-	fprintf(stderr, "replace is %d\n", replace);
+		blur_taps(src, w, taps, 21, out, bmap->w);
 
-	if (replace) {
-		memcpy(bmap->data, dest->data, sizeof *bmap->data * bmap->w * bmap->h);
-		bitmap_destroy(dest);
-		return bmap;
+		row = dest->data + (size_t)y * dest->w;
+		for (x = 0; x < bmap->w; x++)
+			row[x] = (uint32_t)out[x] * 0x010101;
 	}
 
+	free(w);
+	free(ring);
+	free(pad);
+	free(out);
+	free(src);
+
 	return dest;
 }
 
@@ -268,83 +362,83 @@ void bitmap_getregion(const struct bitmap *bmap,
 
 }
 
+/* Reads a P3 or P6 image from 'fp'. Samples are scaled from 0..maxval
+ * (up to 65535) to 0..255; larger ones are clamped. Regular files are
+ * mmap()ed and parsed in place, and the pixels are stored row by row.
+ */
 struct bitmap *bitmap_load_ppm(FILE *fp)
 {
-	char buff[8192];
-	size_t line = 0;
-	size_t pixel_count = 0;
-	int w, h, cc;
-	struct bitmap *bmap;
-	struct rgb255 rgb;
-
-	get_line(fp, buff, sizeof buff, &line);
+	struct ppm_input in;
+	const unsigned char *p, *end;
+	unsigned long w, h, maxval, i;
+	struct bitmap *bmap = NULL;
+	uint8_t *scale = NULL;
+	size_t n, count;
+	int binary;
+
+	if (input_load(fp, &in) != 0)
+		return NULL;
+	p = in.data;
+	end = in.data + in.len;
 
-	if (strlen(buff) >= 2) {
-		if (toupper(buff[0]) != 'P' || buff[1] != '3') {
-			fprintf(stderr, "Header incorrect \"%s\"\n", buff);
-			return NULL;
-		}
+	if (in.len < 2 || p[0] != 'P' || (p[1] != '3' && p[1] != '6')) {
+		fputs("Load PPM, not a P3 or P6 image\n", stderr);
+		goto done;
 	}
+	binary = p[1] == '6';
+	p += 2;
 
-	get_line(fp, buff, sizeof buff, &line);
-	if (sscanf(buff, "%u %u", &w, &h) != 2) {
-		fprintf(stderr, "Load PPM, reading dimensions failed");
-		return NULL;
+	if (!ppm_header_int(&p, end, &w) || !ppm_header_int(&p, end, &h)) {
+		fputs("Load PPM, reading dimensions failed\n", stderr);
+		goto done;
 	}
+	if (w == 0 || h == 0 || w > INT_MAX || h > INT_MAX) {
+		fprintf(stderr, "Load PPM, bad dimensions %lux%lu\n", w, h);
+		goto done;
+	}
+	if (!ppm_header_int(&p, end, &maxval) || maxval == 0 || maxval > 65535) {
+		fputs("Load PPM, colour format not supported\n", stderr);
+		goto done;
+	}
+	if (p == end || !isspace(*p)) {
+		fputs("Load PPM, no pixel data\n", stderr);
+		goto done;
+	}
+	p++;		/* the single whitespace before the pixels */
 
-	get_line(fp, buff, sizeof buff, &line);
-	if ((sscanf(buff, "%u", &cc) != 1) || cc != 255) {
-		fprintf(stderr, "Load PPM, colour format not supported (%d)?\n", cc);
-		return NULL;
+	if (!(scale = malloc(maxval + 1))) {
+		fputs("ERROR: Could not allocate memory for PPM samples\n", stderr);
+		goto done;
 	}
+	for (i = 0; i <= maxval; i++)
+		scale[i] = (i * 255 + maxval / 2) / maxval;
 
 	if (!(bmap = bitmap_new(w, h)))
-		return NULL;
+		goto done;
 
-	/* Don't expect comments in the pixel data, so just use scanf() */
-	while (scanf("%d %d %d", &rgb.r, &rgb.g, &rgb.b) == 3) {
-		bitmap_setpixel(bmap, fromRGB(&rgb),
-				pixel_count % w, pixel_count / w);
-		pixel_count++;
-	}
+	n = (size_t)w * h;
+	if (binary)
+		count = ppm_read_p6(p, end, scale, maxval, bmap->data, n);
+	else
+		count = ppm_read_p3(p, end, scale, maxval, bmap->data, n);
 
-	if (pixel_count != (size_t)w * h) {
+	if (count != n) {
 		fprintf(stderr, "Error: %lu pixels read (expected %lu)\n",
-			pixel_count, (size_t)w * h);
+			(unsigned long)count, (unsigned long)n);
 		bitmap_destroy(bmap);
-		return NULL;
+		bmap = NULL;
 	}
-	return bmap;
 
+done:
+	free(scale);
+	input_release(&in);
+	return bmap;
 }
 
 void bitmap_save_ppm(FILE *fpo, const struct bitmap *bmap)
 {
-	int row, col;
-
-	fprintf(fpo, "P3 %u %u\n255\n", bmap->w, bmap->h); /* PBMP header */
-
-	for (row = 0; row < bmap->h; row++) {
-		for (col = 0; col < bmap->w; col++) {
-			uint32_t c = bitmap_getpixel(bmap, col, row);
-			struct rgb255 rgb;
-			toRGB(c, &rgb);
-			fprintf(fpo, "%-3u %-3u %-3u    ", rgb.r, rgb.g, rgb.b);
-		}
-		fprintf(fpo, "\n");
-	}
-}
-
-uint32_t fromRGB(const struct rgb255 *c)
-{
-	return fromRGB_components(c->r, c->g, c->b);
-}
-
-void toRGB(uint32_t c, struct rgb255 *dest)
-{
-	dest->r = (c >> 16) & 0xff;
-	dest->g = (c >> 8) & 0xff;
-	dest->b = c & 0xff;
+	ppm_write_header(fpo, IMG_P3, bmap->w, bmap->h);
+	ppm_write_rows(fpo, IMG_P3, bmap->data, bmap->w, bmap->h);
 }
 
 uint32_t fromRGB_components(uint8_t r, uint8_t g, uint8_t b)
@@ -393,47 +487,71 @@ uint8_t toGrey_8_gamma(uint32_t c, double gamma)
 	return pow(gsv, 1/gamma);
 }
 
-void bitmap_setpixel(const struct bitmap *bmap, uint32_t c,
-		int x, int y)
-{
-	bmap->data[x + y * bmap->w] = c;
-}
-
-uint32_t bitmap_getpixel(const struct bitmap *bmap, int x, int y)
-{
-	return bmap->data[x + y * bmap->w];
-}
-
 /***************************************************************************
  * Misc
  ***************************************************************************/
 
-char *get_line(FILE *fp, char *buff, size_t sz, size_t *linenum)
+/* Reads all of 'fp' into 'in'. Regular files read from the start are
+ * mmap()ed instead of copied.
+ *
+ * Returns 0 on success, non-zero (after printing a message) on failure.
+ */
+int input_load(FILE *fp, struct ppm_input *in)
 {
-	const char *s;
+	struct stat st;
+	unsigned char *buff = NULL;
+	size_t len = 0, max_len = 0, n;
+	int fd = fileno(fp);
+
+	in->map_len = 0;
+
+	if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+			&& st.st_size > 0 && lseek(fd, 0, SEEK_CUR) == 0) {
+		void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m != MAP_FAILED) {
+			madvise(m, st.st_size, MADV_SEQUENTIAL);
+			in->data = m;
+			in->len = in->map_len = st.st_size;
+			return 0;
+		}
+	}
 
 	do {
-		if (!fgets(buff, sz, fp))
-			return NULL;
-
-		if (linenum)
-			++*linenum;
+		if (len == max_len) {
+			unsigned char *tmp;
+			max_len = max_len ? max_len * 2 : 65536;
+			if ((tmp = realloc(buff, max_len)) == NULL) {
+				fputs("ERROR: Could not allocate memory for input\n",
+						stderr);
+				free(buff);
+				return 1;
+			}
+			buff = tmp;
+		}
+		n = fread(buff + len, 1, max_len - len, fp);
+		len += n;
+	} while (n > 0);
+
+	if (ferror(fp)) {
+		fprintf(stderr, "ERROR: Reading input failed: %s\n",
+				strerror(errno));
+		free(buff);
+		return 1;
+	}
 
-		s = skip_leading_spaces(buff);
-		if (*s == '\0' || *s == '#')
-			continue;	// skip empty lines and comments
-		else
-			return buff;
-	} while (1);
+	in->data = buff;
+	in->len = len;
 
-	return NULL;
+	return 0;
 }
 
-const char *skip_leading_spaces(const char *s)
+void input_release(struct ppm_input *in)
 {
-	while (isspace(*s))
-		s++;
-	return s;
+	if (in->map_len)
+		munmap((void *)in->data, in->map_len);
+	else
+		free((void *)in->data);
+	in->data = NULL;
 }
 
 /***************************************************************************
@@ -464,3 +582,291 @@ static int sobel_getgradient(const uint32_t region[9], int horiz)
 
 	return gradient;
 }
+
+/***************************************************************************
+ * PPM helper functions
+ ***************************************************************************/
+
+/* Reads an unsigned header field at '*p', skipping whitespace and '#'
+ * comments before it, and leaves '*p' just after its last digit. Returns 1
+ * on success, 0 if there is no number.
+ */
+static int ppm_header_int(const unsigned char **p, const unsigned char *end,
+		unsigned long *v)
+{
+	const unsigned char *s = *p;
+	unsigned long n = 0;
+
+	while (s < end && (isspace(*s) || *s == '#')) {
+		if (*s == '#')
+			while (s < end && *s != '\n')
+				s++;
+		else
+			s++;
+	}
+	if (s == end || (unsigned)(*s - '0') > 9)
+		return 0;
+
+	do {
+		unsigned d = *s++ - '0';
+
+		if (n > (ULONG_MAX - d) / 10)
+			return 0;
+		n = n * 10 + d;
+	} while (s < end && (unsigned)(*s - '0') <= 9);
+
+	*v = n;
+	*p = s;
+	return 1;
+}
+
+/* Parses up to 'n' ASCII pixels into 'dest'. Samples are separated by any
+ * whitespace (or control characters); anything else ends the pixel data.
+ * Returns the number of pixels read.
+ *
+ * With SSE2 the input is classified 16 bytes at a time into digit and
+ * non-blank masks, and the numbers of each window are found from the bit
+ * masks, so there is no branch per byte. Numbers that don't end inside
+ * a window continue in the next one; the end of the block and anything
+ * unusual go through the plain scanner.
+ */
+static size_t ppm_read_p3(const unsigned char *p, const unsigned char *end,
+		const uint8_t *scale, unsigned long maxval, uint32_t *dest,
+		size_t n)
+{
+	enum { BLOCK = 3 * 1024 };
+	uint32_t samples[BLOCK];
+	size_t i = 0, j, k;
+#ifdef __SSE2__
+	static const int place[4][3] = {
+		{ 0, 0, 0 }, { 1, 0, 0 }, { 10, 1, 0 }, { 100, 10, 1 }
+	};
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i blank = _mm_set1_epi8(' ' + 1);
+#endif
+
+	while (i < n) {
+		size_t want = 3 * (n - i) < BLOCK ? 3 * (n - i) : BLOCK;
+
+		k = 0;
+#ifdef __SSE2__
+		while (k + 16 <= want && end - p >= 32) {
+			__m128i b = _mm_loadu_si128((const __m128i *)p);
+			__m128i d = _mm_sub_epi8(b, zero);
+			unsigned dig = _mm_movemask_epi8(_mm_cmpeq_epi8(
+					_mm_min_epu8(d, nine), d));
+			unsigned nb = _mm_movemask_epi8(_mm_cmpeq_epi8(
+					_mm_max_epu8(b, blank), b));
+			unsigned starts = dig & ~(dig << 1);
+			unsigned ends = ~dig & (dig << 1) & 0xffff;
+			int last = 0;
+
+			if (nb & ~dig)
+				break;		/* not a digit or blank */
+			if (starts == 0) {
+				p += 16;
+				continue;
+			}
+			while (starts && ends) {
+				int s = __builtin_ctz(starts);
+				int e = __builtin_ctz(ends);
+				int len = e - s;
+				uint32_t v;
+
+				if (len <= 3) {
+					v = (p[s] - '0') * place[len][0]
+						+ (p[s + 1] - '0') * place[len][1]
+						+ (p[s + 2] - '0') * place[len][2];
+				} else {
+					const unsigned char *q;
+
+					for (v = 0, q = p + s; q < p + e; q++)
+						v = v * 10 + (unsigned)(*q - '0');
+				}
+				samples[k++] = v;
+				starts &= starts - 1;
+				ends &= ends - 1;
+				last = e;
+			}
+			if (last == 0) {
+				if (starts & 1)
+					break;	/* a number filling the window */
+				last = __builtin_ctz(starts);
+			}
+			p += last;
+		}
+#endif
+		/* the rest of the block, one byte at a time */
+		for ( ; k < want; k++) {
+			uint32_t v;
+
+			while (p < end && *p <= ' ')
+				p++;
+			if (p == end || (unsigned)(*p - '0') > 9)
+				break;
+
+			v = (unsigned)(*p++ - '0');
+			while (p < end && (unsigned)(*p - '0') <= 9)
+				v = v * 10 + (unsigned)(*p++ - '0');
+			samples[k] = v < maxval ? v : maxval;
+		}
+
+		for (j = 0; j + 3 <= k; j += 3, i++)
+			dest[i] = (uint32_t)scale[samples[j] < maxval
+						? samples[j] : maxval] << 16
+					| (uint32_t)scale[samples[j + 1] < maxval
+						? samples[j + 1] : maxval] << 8
+					| scale[samples[j + 2] < maxval
+						? samples[j + 2] : maxval];
+		if (k < want)
+			break;		/* the pixel data ended */
+	}
+	return i;
+}
+
+/* Copies up to 'n' binary pixels (1 byte per sample, or 2 big-endian bytes
+ * if maxval > 255) into 'dest'. Returns the number of pixels read.
+ */
+static size_t ppm_read_p6(const unsigned char *p, const unsigned char *end,
+		const uint8_t *scale, unsigned long maxval, uint32_t *dest,
+		size_t n)
+{
+	size_t i, avail;
+
+	if (maxval > 255) {
+		avail = (size_t)(end - p) / 6;
+		n = n < avail ? n : avail;
+		for (i = 0; i < n; i++, p += 6) {
+			unsigned long r = p[0] << 8 | p[1];
+			unsigned long g = p[2] << 8 | p[3];
+			unsigned long b = p[4] << 8 | p[5];
+
+			dest[i] = (uint32_t)scale[r < maxval ? r : maxval] << 16
+					| (uint32_t)scale[g < maxval ? g : maxval] << 8
+					| scale[b < maxval ? b : maxval];
+		}
+		return n;
+	}
+
+	avail = (size_t)(end - p) / 3;
+	n = n < avail ? n : avail;
+	if (maxval == 255) {
+		for (i = 0; i < n; i++, p += 3)
+			dest[i] = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+		return n;
+	}
+	for (i = 0; i < n; i++, p += 3)
+		dest[i] = (uint32_t)scale[p[0] < maxval ? p[0] : maxval] << 16
+				| (uint32_t)scale[p[1] < maxval ? p[1] : maxval] << 8
+				| scale[p[2] < maxval ? p[2] : maxval];
+	return n;
+}
+
+/***************************************************************************
+ * Blur helper functions
+ ***************************************************************************/
+
+/* Returns the 2 * radius + 1 weights of a gaussian with standard deviation
+ * 'sigma', scaled to add up to exactly 1 << 14, or NULL if memory ran out.
+ * A 'sigma' of 0 gives the identity.
+ */
+static int16_t *blur_kernel(double sigma, int radius)
+{
+	int taps = 2 * radius + 1, k, sum = 0, left, step, best;
+	double *g, total = 0;
+	int16_t *w;
+
+	g = malloc(taps * sizeof *g);
+	w = malloc(taps * sizeof *w);
+	if (!g || !w) {
+		free(g);
+		free(w);
+		return NULL;
+	}
+
+	for (k = 0; k < taps; k++) {
+		double d = k - radius;
+
+		g[k] = sigma > 0 ? exp(-d * d / (2 * sigma * sigma)) : 1;
+		total += g[k];
+	}
+	for (k = 0; k < taps; k++) {
+		g[k] = g[k] / total * (1 << 14);
+		w[k] = floor(g[k] + 0.5);
+		sum += w[k];
+	}
+
+	/* Rounding leaves the sum a few units off. Hand them out one per tap
+	 * to the taps that were rounded furthest the other way, in mirrored
+	 * pairs to keep the kernel symmetric (the centre takes an odd unit),
+	 * rather than piling them all onto the centre.
+	 */
+	left = (1 << 14) - sum;
+	if (left & 1) {
+		step = left > 0 ? 1 : -1;
+		w[radius] += step;
+		left -= step;
+	}
+	while (left) {
+		step = left > 0 ? 1 : -1;
+		best = 0;
+		for (k = 1; k < radius; k++)
+			if (step * (g[k] - w[k]) > step * (g[best] - w[best]))
+				best = k;
+		w[best] += step;
+		w[taps - 1 - best] += step;
+		left -= 2 * step;
+	}
+
+	free(g);
+	return w;
+}
+
+/* dest[x] = (sum of w[k] * src[k][x] over the 'taps' sources, rounded)
+ * >> shift, for x < n. Sources are at most 32767 and the sum of the
+ * weights is 1 << 14, so the sums fit in 31 bits.
+ *
+ * With SSE2, 8 columns are done at a time and taps are taken in pairs:
+ * the two rows are interleaved so that one pmaddwd multiplies and adds
+ * both.
+ */
+static void blur_taps(const int16_t *const *src, const int16_t *w, int taps,
+		int shift, int16_t *dest, int n)
+{
+	int32_t round = 1 << (shift - 1);
+	int x = 0, k;
+
+#ifdef __SSE2__
+	const __m128i vround = _mm_set1_epi32(round);
+
+	for ( ; x + 8 <= n; x += 8) {
+		__m128i lo = vround, hi = vround;
+
+		for (k = 0; k < taps; k += 2) {
+			/* an odd last tap is paired with itself at weight 0 */
+			int k2 = k + 1 < taps ? k + 1 : k;
+			int w2 = k + 1 < taps ? w[k + 1] : 0;
+			__m128i a = _mm_loadu_si128((const __m128i *)(src[k] + x));
+			__m128i b = _mm_loadu_si128((const __m128i *)(src[k2] + x));
+			__m128i wp = _mm_set1_epi32((uint16_t)w[k]
+					| (uint32_t)(uint16_t)w2 << 16);
+
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b),
+					wp));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b),
+					wp));
+		}
+		lo = _mm_srai_epi32(lo, shift);
+		hi = _mm_srai_epi32(hi, shift);
+		_mm_storeu_si128((__m128i *)(dest + x), _mm_packs_epi32(lo, hi));
+	}
+#endif
+	for ( ; x < n; x++) {
+		int32_t v = round;
+
+		for (k = 0; k < taps; k++)
+			v += w[k] * src[k][x];
+		dest[x] = v >> shift;
+	}
+}
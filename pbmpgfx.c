@@ -0,0 +1,4527 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pbmpgfx.h"
+
+#define SWAP(type,x,y) do { type temp = (x); (x) = (y); (y) = temp; } while (0)
+
+/* Compiled display list ("-c"): a 20 byte header followed by fixed-size
+ * records and the vertex pool of polyline and polygon commands, all fields
+ * little-endian. Version 1 lists end after the records.
+ *
+ *   header:  "PBDL"  u32 version  i32 w  i32 h  u32 n_records
+ *   record:  u32 cmd_id  u32 colour  i32 args[4]
+ *   pool:    u32 n_verts  i32 verts[n_verts]
+ */
+#define DLIST_MAGIC      "PBDL"
+#define DLIST_VERSION    2
+#define DLIST_HEADER_SZ  20
+#define DLIST_RECORD_SZ  24
+
+/* Render cache ("-C dir"): a checkpoint of the canvas after the first
+ * n_cmds commands, stored as <dir>/<hash>.pbck where <hash> (16 hex digits)
+ * chains the dimensions and those commands. The header is little-endian;
+ * the pixels follow in host byte order.
+ *
+ *   header:  "PBCK"  u32 version  i32 w  i32 h  u32 n_cmds lo, hi
+ *            u32 hash lo, hi
+ */
+#define CACHE_MAGIC      "PBCK"
+#define CACHE_VERSION    1
+#define CACHE_HEADER_SZ  32
+#define CACHE_SUFFIX     ".pbck"
+
+/* Tiled rendering: the maximum number of (tile, command) bin entries built
+ * at once. Larger batches are split, which is safe because batches are
+ * rendered in order.
+ */
+#define TILE_MAX_BINNED    (16 * 1024 * 1024)
+
+/* Render server: connections accepted but not yet picked up by a worker */
+#define SERVE_QUEUE_SZ     64
+
+/* Render server: seconds a client may stall while sending its script or
+ * reading the image before its connection is dropped
+ */
+#define SERVE_TIMEOUT_S    30
+
+/* Ellipses: ellipse_row_x() evaluates b^2 x^2 + a^2 y^2 - a^2 b^2 for
+ * radii a and b, which takes 124 bits for int radii, while the error terms
+ * of draw_ellipse() grow to about 4 * radius^3 and fit a long long up to
+ * ELLIPSE_LL_RADIUS_MAX. Without a 128-bit type, ellipses with radii above
+ * CONIC_RADIUS_MAX are not drawn.
+ */
+#define ELLIPSE_LL_RADIUS_MAX  (1 << 19)
+
+#ifdef __SIZEOF_INT128__
+typedef __int128 conic_t;
+#define CONIC_RADIUS_MAX   INT_MAX
+#else
+typedef long long conic_t;
+#define CONIC_RADIUS_MAX   30000
+#endif
+
+/* draw_segment() ends to leave out */
+#define SEG_SKIP_START     1
+#define SEG_SKIP_END       2
+
+
+/***************************************************************************/
+
+/* A canvas buffer kept across batch jobs; 'cap' is in pixels */
+struct canvas_buf {
+	uint32_t *data;
+	size_t cap;
+};
+
+enum cmd_id {
+	CMD_POINT, CMD_LINE, CMD_RECT, CMD_CIRCLE, CMD_ELLIPSE, CMD_FILL,
+	CMD_FCIRCLE, CMD_FELLIPSE, CMD_SMARTFILL, CMD_POLYLINE, CMD_POLYGON,
+	CMD_COUNT
+};
+
+/* Counters for --stats. Pixel counts are kept by the primitives: a pixel is
+ * "clipped" if a primitive would have drawn it but it lies outside the
+ * clip rectangle. Ellipse outlines, filled circles and ellipses and
+ * polygons don't visit the parts of the arc or the rows that are outside
+ * the clip window, so those aren't counted.
+ */
+struct render_stats {
+	double t_parse, t_cull, t_cache, t_render, t_encode;	/* seconds */
+	size_t input_bytes;
+	size_t n_cmds;
+	size_t n_cached;		/* commands restored from a checkpoint */
+	size_t n_culled;		/* commands dropped by cull_cmds() */
+	size_t n_trimmed;		/* rects it cut down */
+	unsigned long long pixels_culled;	/* of solid shapes it removed */
+	unsigned long cmd_count[CMD_COUNT];
+	double cmd_time[CMD_COUNT];
+	unsigned long long pixels_written;
+	unsigned long long pixels_clipped;
+	size_t fill_max_depth;		/* fill work stack high-water mark */
+};
+
+#define STAT_PIXELS(bmap, written, requested) \
+	do { \
+		if ((bmap)->stats) { \
+			(bmap)->stats->pixels_written += (written); \
+			(bmap)->stats->pixels_clipped += (requested) - (written); \
+		} \
+	} while (0)
+
+struct cmd_def {
+	const char *str;
+	enum cmd_id id;
+	int nargs;		/* integer arguments following "r g b", or -1 for a
+				   list of "row col" vertices */
+};
+
+/* A parsed command. 'args' hold the coordinate arguments in the order they
+ * appear in the script (row before col), e.g. "rect r g b row col h w" is
+ * stored as { row, col, h, w }. Polylines and polygons store { first,
+ * count }: their vertices are the 'count' row, col pairs starting at
+ * index 'first' of the list's vertex pool.
+ */
+struct cmd {
+	enum cmd_id id;
+	uint32_t colour;
+	int args[4];
+};
+
+struct cmd_list {
+	size_t n;
+	size_t max_elems;
+	struct cmd *cmds;
+	int *verts;		/* vertex pool */
+	size_t n_verts;
+	size_t max_verts;
+};
+
+/* The whole input script, either mmap()ed or read into memory */
+struct script_buf {
+	const char *data;
+	size_t len;
+	size_t map_len;		/* non-zero if 'data' is a mapping */
+	const char *name;	/* file name for messages, or NULL */
+};
+
+/* Cursor over a single line of a script_buf; 'eol' is the end of the line
+ * (exclusive, not including the newline).
+ */
+struct lexer {
+	const char *p;
+	const char *eol;
+};
+
+/* Minimal fixed-size thread pool: pool_run() runs the same job function on
+ * every worker and on the calling thread, and returns when all are done.
+ */
+struct thread_pool {
+	pthread_t *threads;
+	int n_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cv;
+	pthread_cond_t done_cv;
+	void (*fn)(void *arg);
+	void *arg;
+	unsigned long generation;
+	int busy;		/* workers still running the current job */
+	int quit;
+};
+
+/* A command and the rows [y1, y2) it may draw to, for render_banded() */
+struct band_ref {
+	size_t idx;
+	int y1, y2;
+};
+
+/* The jobs of a --batch manifest, shared by the batch workers */
+struct batch {
+	char **inputs;
+	char **outputs;
+	size_t n;
+	size_t next;
+	size_t failed;
+	const struct render_opts *opts;
+	pthread_mutex_t lock;
+};
+
+/* Render server state shared by the accepting thread and the workers.
+ * 'queue' is a ring of SERVE_QUEUE_SZ accepted connections.
+ */
+struct server {
+	int queue[SERVE_QUEUE_SZ];
+	size_t head, count;
+	int quit;
+	unsigned long served;
+	const struct render_opts *opts;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+/* One batch of binned commands shared by the tile workers */
+struct tile_job {
+	const struct bitmap *bmap;
+	const struct cmd *cmds;
+	const int *verts;
+	const uint32_t *bins;		/* command indices grouped by tile */
+	const size_t *bin_start;	/* tile t: bins[bin_start[t]..bin_start[t+1]) */
+	int tiles_x;
+	int n_tiles;
+	int next_tile;
+	pthread_mutex_t lock;
+};
+
+/* An edge of a filled polygon in the active edge table. On the current
+ * row it crosses x + f / dy (0 <= f < dy), and it moves by qs + rs / dy
+ * per row until row y2 (exclusive).
+ */
+struct poly_edge {
+	int y1, y2;
+	long long x, qs;
+	unsigned long long f, rs, dy;
+};
+
+/* Opaque coverage for cull_cmds(): for each row, the sorted, disjoint and
+ * non-adjacent [x1, x2) intervals that later commands paint over
+ */
+struct cover_row {
+	int *iv;		/* x1, x2 pairs */
+	int n, max;		/* in pairs */
+};
+
+struct coverage {
+	struct cover_row *rows;
+	int w, h;
+	int full_rows;		/* rows covered from 0 to w */
+	int *dirty;		/* rows that have intervals */
+	int n_dirty;
+};
+
+/* Flood fill work item: row 'y' - 'dy' has been filled over x1..x2,
+ * row 'y' still has to be explored there.
+ */
+struct fill_span {
+	int y, x1, x2, dy;
+};
+
+/* Which pixels a flood fill spreads into: those equal to 'colour' if
+ * 'tol2' < 0, otherwise those whose squared RGB distance to 'colour' is
+ * below 'tol2'. If the fill colour itself matches, 'seen' is a w*h mask of
+ * the pixels already filled so they are not visited again; else NULL.
+ */
+struct fill_match {
+	uint32_t colour;
+	int tol2;
+	uint8_t *seen;
+};
+
+/* Growable stack of fill_spans. Storage is a list of fixed-size chunks so
+ * pushing never moves existing entries; one emptied chunk is kept spare to
+ * avoid malloc()/free() churn at a chunk boundary.
+ */
+#define SPAN_CHUNK_SZ 4096
+
+struct span_chunk {
+	struct span_chunk *prev;
+	struct fill_span spans[SPAN_CHUNK_SZ];
+};
+
+struct span_stack {
+	struct span_chunk *top;
+	struct span_chunk *spare;
+	size_t n;		/* entries used in 'top' */
+	size_t depth;
+	size_t max_depth;	/* high-water mark */
+};
+
+/***************************************************************************
+ * "Private" functions
+ ***************************************************************************/
+
+static int render_job(FILE *fpi, FILE *fpo, const char *name,
+		const struct render_opts *opts, struct canvas_buf *canvas);
+static int parse_script(const struct script_buf *sb, struct bitmap *bmap,
+		struct cmd_list *cmds);
+static const struct cmd_def *cmd_lookup(const char *s, size_t len);
+static int parse_cmd(struct lexer *lx, const struct cmd_def *def, struct cmd *cmd,
+		struct cmd_list *cmds);
+static void cmd_exec(const struct cmd *cmd, const int *verts,
+		const struct bitmap *bmap);
+static int cmd_is_barrier(const struct cmd *cmd);
+static int cmd_bbox(const struct cmd *cmd, const int *verts,
+		const struct rect *clip, struct rect *r);
+
+static void render_cmds(const struct bitmap *bmap, const struct cmd_list *cmds,
+		struct thread_pool *pool);
+static int render_tiled(const struct bitmap *bmap, const struct cmd_list *cmds,
+		struct thread_pool *pool);
+static int render_banded(FILE *fpo, const struct bitmap *bmap,
+		const struct cmd_list *cmds, int band_rows,
+		enum image_format format);
+
+static int cull_cmds(const struct bitmap *bmap, struct cmd_list *cmds,
+		struct render_stats *st);
+
+static int stats_report(const char *path, const struct render_stats *st);
+
+static int pool_init(struct thread_pool *pool, int n_threads);
+static void pool_run(struct thread_pool *pool, void (*fn)(void *arg), void *arg);
+static void pool_destroy(struct thread_pool *pool);
+
+static int dlist_is_compiled(const struct script_buf *sb);
+static int dlist_read(const struct script_buf *sb, struct bitmap *bmap,
+		struct cmd_list *cmds);
+static int dlist_write(FILE *fpo, const struct bitmap *bmap,
+		const struct cmd_list *cmds);
+
+static void cache_hashes(const struct bitmap *bmap, const struct cmd_list *cmds,
+		uint64_t *hashes);
+static size_t cache_restore(const char *dir, const struct bitmap *bmap,
+		const uint64_t *hashes, size_t n);
+static void cache_save(const char *dir, const struct bitmap *bmap, size_t n,
+		uint64_t hash);
+
+static int script_load(FILE *fp, struct script_buf *sb);
+static void script_release(struct script_buf *sb);
+
+static int lex_int(struct lexer *lx, int *v);
+static size_t lex_word(struct lexer *lx, const char **word);
+static void lex_space(struct lexer *lx);
+
+static int cmd_list_push(struct cmd_list *list, const struct cmd *cmd);
+static int cmd_list_push_vert(struct cmd_list *list, int v);
+static void cmd_list_free(struct cmd_list *list);
+
+static int bitmap_alloc(struct bitmap *bmap, const char *path, int unique);
+static int canvas_get(struct canvas_buf *canvas, struct bitmap *bmap);
+static void bitmap_free(struct bitmap *bmap);
+
+static void draw_segment(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *p1, const struct point2d *p2, int skip);
+static void draw_vline(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *p1, const struct point2d *p2);
+static void draw_hline(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *p1, const struct point2d *p2);
+static void draw_fill_scanline(const struct bitmap *bmap, uint32_t fill_colour,
+		const struct point2d *p, uint32_t match_colour);
+
+static void span_stack_init(struct span_stack *stack);
+static void span_stack_destroy(struct span_stack *stack);
+static int span_stack_push(struct span_stack *stack, int y, int x1, int x2, int dy);
+static int span_stack_pop(struct span_stack *stack, struct fill_span *span);
+
+static double clock_seconds(void);
+
+static void fill_u32(uint32_t *dest, uint32_t c, size_t n);
+static void put_u32(uint32_t *dest, uint32_t c, size_t n);
+static void put_u32_strided(uint32_t *dest, ptrdiff_t stride, uint32_t c,
+		size_t n);
+static uint32_t blend_px(uint32_t dest, uint32_t c);
+static void blend_u32(uint32_t *dest, uint32_t c, size_t n);
+static int scan_right_ne(const uint32_t *row, int x, int end, uint32_t c);
+static int scan_left_ne(const uint32_t *row, int x, int start, uint32_t c);
+static int scan_right_eq(const uint32_t *row, int x, int end, uint32_t c);
+static int colour_dist2(uint32_t a, uint32_t b);
+static int match_pixel(const struct fill_match *m, const uint32_t *row,
+		const uint8_t *seen, int x);
+static int match_right_ne(const struct fill_match *m, const uint32_t *row,
+		const uint8_t *seen, int x, int end);
+static int match_left_ne(const struct fill_match *m, const uint32_t *row,
+		const uint8_t *seen, int x, int start);
+static int match_right_eq(const struct fill_match *m, const uint32_t *row,
+		const uint8_t *seen, int x, int end);
+static void fill_spans(const struct bitmap *bmap, uint32_t fill_colour,
+		const struct point2d *p, const struct fill_match *m);
+static char *cache_path(const char *dir, uint64_t hash, const char *suffix);
+static int u64_cmp(const void *a, const void *b);
+static int band_ref_cmp_y(const void *a, const void *b);
+static int band_ref_cmp_idx(const void *a, const void *b);
+static void script_error(const struct script_buf *sb, const char *fmt, ...);
+static void job_note(const char *name, const char *fmt, ...);
+static char *temp_path(const char *path);
+static void batch_worker(void *arg);
+static void *serve_worker(void *arg);
+static void serve_handle(struct server *srv, int fd,
+		struct canvas_buf *canvas);
+static int unix_address(const char *path, struct sockaddr_un *addr);
+static int unix_remove(const char *path);
+static void serve_stop(int sig);
+static void render_tile_worker(void *arg);
+static void *pool_worker(void *arg);
+static void draw_spans_mirrored(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *center, const int *halfwidth, int d1, int d2);
+static long long circle_y(long long r2, long long x);
+static long long circle_xend(long long r2, int radius);
+static void circle_arc(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *center, long long r2, long long xend, int oct);
+static int clip_range(int lo, int hi, int centre, int sign,
+		long long *min, long long *max);
+static int poly_edge_cmp(const void *a, const void *b);
+static int mirrored_rows(int lo, int hi, int centre, int radius,
+		int *d1, int *d2);
+static long long isqrt_ll(long long n);
+static int *fcircle_rows(int radius, int d1, int d2);
+static long ellipse_row_x(conic_t a2, conic_t b2, int radius1, long y);
+static int ellipse_steps_down(conic_t a2, conic_t b2, long x, long y);
+static int *fellipse_rows(int radius1, int radius2, int d1, int d2);
+static int cull_rect(struct coverage *cov, const struct cmd *cmd,
+		struct cmd_list *out, struct render_stats *st);
+static int cull_conic(struct coverage *cov, const struct cmd *cmd,
+		struct cmd_list *out, struct render_stats *st);
+static int cover_init(struct coverage *cov, int w, int h);
+static void cover_free(struct coverage *cov);
+static void cover_reset(struct coverage *cov);
+static int cover_add(struct coverage *cov, int y, int x1, int x2);
+static int cover_gap(const struct coverage *cov, int y, int x1, int x2,
+		int *lo, int *hi);
+static int cover_search(const struct cover_row *row, int which, int x);
+
+/***************************************************************************/
+
+
+/***************************************************************************
+ * Input parsing
+ ***************************************************************************/
+
+/* Sets the defaults of the pbmpgfx command: P3 output on one thread */
+void render_opts_init(struct render_opts *opts)
+{
+	opts->format = IMG_P3;
+	opts->compile = 0;
+	opts->threads = 1;
+	opts->verbose = 0;
+	opts->canvas_file = NULL;
+	opts->band_rows = 0;
+	opts->cache_dir = NULL;
+	opts->stats = 0;
+	opts->stats_file = NULL;
+	opts->cull = 0;
+}
+
+int parse_file(FILE *fpi, FILE *fpo, const struct render_opts *opts)
+{
+	return render_job(fpi, fpo, NULL, opts, NULL);
+}
+
+/* Renders the script or display list read from 'fpi' to 'fpo'. 'name' is
+ * used to prefix messages about the input; if 'canvas' is not NULL the
+ * canvas is taken from (and left in) it instead of being allocated.
+ *
+ * Returns 0 on success, non-zero on error.
+ */
+static int render_job(FILE *fpi, FILE *fpo, const char *name,
+		const struct render_opts *opts, struct canvas_buf *canvas)
+{
+	struct script_buf sb;
+	struct cmd_list cmds = { 0, 0, NULL, NULL, 0, 0 };
+	struct bitmap bmap;
+	struct cmd_list todo;
+	struct thread_pool pool;
+	struct render_stats stats;
+	uint64_t *hashes = NULL;
+	double t0, t;
+	size_t i;
+	int err, compiled;
+
+	if (script_load(fpi, &sb) != 0)
+		return 1;
+	sb.name = name;
+
+	memset(&stats, 0, sizeof stats);
+	t0 = clock_seconds();
+	bmap.data = NULL;
+	bmap.map_len = 0;
+	bmap.stats = NULL;
+	if ((compiled = dlist_is_compiled(&sb)))
+		err = dlist_read(&sb, &bmap, &cmds);
+	else
+		err = parse_script(&sb, &bmap, &cmds);
+	stats.t_parse = t = clock_seconds() - t0;
+	stats.input_bytes = sb.len;
+	stats.n_cmds = cmds.n;
+
+	if (opts->verbose) {
+		job_note(name, "%s: %lu bytes, %lu commands in %.3f ms"
+				" (%.1f MB/s)\n", compiled ? "load" : "parse",
+				(unsigned long)sb.len, (unsigned long)cmds.n, t * 1e3,
+				t > 0 ? sb.len / t / 1e6 : 0.0);
+	}
+
+	script_release(&sb);
+
+	if (err == 0 && opts->cull) {
+		t0 = clock_seconds();
+		if (cull_cmds(&bmap, &cmds, &stats) != 0)
+			fputs("ERROR: Could not allocate memory for culling,"
+					" rendering every command\n", stderr);
+		stats.t_cull = t = clock_seconds() - t0;
+		if (opts->verbose)
+			job_note(name, "cull: %lu commands dropped, %lu trimmed,"
+					" %llu pixels in %.3f ms\n",
+					(unsigned long)stats.n_culled,
+					(unsigned long)stats.n_trimmed, stats.pixels_culled,
+					t * 1e3);
+	}
+
+	if (err == 0 && opts->band_rows > 0 && !opts->compile
+			&& !opts->cache_dir && !opts->stats) {
+		for (i = 0; i < cmds.n && !cmd_is_barrier(&cmds.cmds[i]); i++)
+			;
+		if (i == cmds.n) {
+			bmap.clip.x1 = bmap.clip.y1 = 0;
+			bmap.clip.x2 = bmap.w;
+			bmap.clip.y2 = bmap.h;
+			err = render_banded(fpo, &bmap, &cmds, opts->band_rows,
+					opts->format);
+			if (err == 0 && fflush(fpo) != 0) {
+				fputs("ERROR: Writing output image failed\n", stderr);
+				err = 1;
+			}
+			cmd_list_free(&cmds);
+			return err;
+		}
+		if (opts->verbose)
+			job_note(name, "bands: the script has fills, rendering the"
+					" whole canvas\n");
+	}
+
+	if (err == 0 && opts->compile) {
+		err = dlist_write(fpo, &bmap, &cmds);
+	} else if (err == 0 && canvas && !opts->canvas_file) {
+		err = canvas_get(canvas, &bmap);
+	} else if (err == 0) {
+		err = bitmap_alloc(&bmap, opts->canvas_file, canvas != NULL);
+	}
+
+	if (err == 0 && !opts->compile) {
+		bmap.clip.x1 = bmap.clip.y1 = 0;
+		bmap.clip.x2 = bmap.w;
+		bmap.clip.y2 = bmap.h;
+
+		t0 = clock_seconds();
+		if (opts->cache_dir
+				&& (hashes = malloc((cmds.n + 1) * sizeof *hashes))) {
+			cache_hashes(&bmap, &cmds, hashes);
+			stats.n_cached = cache_restore(opts->cache_dir, &bmap, hashes,
+					cmds.n);
+			if (opts->verbose)
+				job_note(name, "cache: resuming after %lu of %lu"
+						" commands\n", (unsigned long)stats.n_cached,
+						(unsigned long)cmds.n);
+		}
+		stats.t_cache = clock_seconds() - t0;
+
+		todo = cmds;
+		todo.cmds += stats.n_cached;
+		todo.n -= stats.n_cached;
+		t0 = clock_seconds();
+		if (opts->stats) {
+			bmap.stats = &stats;
+			render_cmds(&bmap, &todo, NULL);
+			bmap.stats = NULL;
+		} else if (opts->threads > 1
+				&& pool_init(&pool, opts->threads - 1) == 0) {
+			render_cmds(&bmap, &todo, &pool);
+			pool_destroy(&pool);
+		} else {
+			render_cmds(&bmap, &todo, NULL);
+		}
+		stats.t_render = t = clock_seconds() - t0;
+		if (opts->verbose) {
+			job_note(name, "render: %lu commands in %.3f ms"
+					" (%.0f commands/s, %.1f Mpixel/s)\n",
+					(unsigned long)todo.n, t * 1e3,
+					t > 0 ? todo.n / t : 0.0,
+					t > 0 ? (double)bmap.w * bmap.h / t / 1e6 : 0.0);
+		}
+
+		t0 = clock_seconds();
+		if (bitmap_to_pbmp(fpo, &bmap, opts->format) != 0)
+			err = 1;
+		stats.t_encode = t = clock_seconds() - t0;
+		if (opts->verbose) {
+			job_note(name, "encode: %.0f pixels in %.3f ms"
+					" (%.1f Mpixel/s)\n", (double)bmap.w * bmap.h,
+					t * 1e3,
+					t > 0 ? (double)bmap.w * bmap.h / t / 1e6 : 0.0);
+		}
+
+		if (hashes && stats.n_cached < cmds.n)
+			cache_save(opts->cache_dir, &bmap, cmds.n, hashes[cmds.n]);
+
+		if (opts->stats && stats_report(opts->stats_file, &stats) != 0)
+			err = 1;
+	}
+
+	free(hashes);
+	cmd_list_free(&cmds);
+	if (canvas && bmap.data == canvas->data)
+		bmap.data = NULL;	/* stays with the caller */
+	bitmap_free(&bmap);
+
+	return err;
+}
+
+/* Renders the script or display list in 'data' (which need not be
+ * terminated) onto a new canvas of the size it gives. Of 'opts' (NULL for
+ * the defaults) only 'threads', 'cull' and 'canvas_file' apply.
+ *
+ * Returns the canvas, to be freed with bitmap_destroy(), or NULL on error.
+ */
+struct bitmap *script_render(const char *data, size_t len,
+		const struct render_opts *opts)
+{
+	struct script_buf sb;
+	struct cmd_list cmds = { 0, 0, NULL, NULL, 0, 0 };
+	struct render_opts defaults;
+	struct render_stats stats;
+	struct thread_pool pool;
+	struct bitmap *bmap;
+	int err;
+
+	if (opts == NULL) {
+		render_opts_init(&defaults);
+		opts = &defaults;
+	}
+	if ((bmap = malloc(sizeof *bmap)) == NULL) {
+		fputs("ERROR: Could not allocate memory for the canvas\n", stderr);
+		return NULL;
+	}
+
+	sb.data = data;
+	sb.len = len;
+	sb.map_len = 0;
+	sb.name = NULL;
+	bmap->data = NULL;
+	bmap->map_len = 0;
+	bmap->stats = NULL;
+	if (dlist_is_compiled(&sb))
+		err = dlist_read(&sb, bmap, &cmds);
+	else
+		err = parse_script(&sb, bmap, &cmds);
+
+	memset(&stats, 0, sizeof stats);
+	if (err == 0 && opts->cull && cull_cmds(bmap, &cmds, &stats) != 0)
+		fputs("ERROR: Could not allocate memory for culling,"
+				" rendering every command\n", stderr);
+
+	if (err == 0)
+		err = bitmap_alloc(bmap, opts->canvas_file, 0);
+	if (err == 0) {
+		bmap->clip.x1 = bmap->clip.y1 = 0;
+		bmap->clip.x2 = bmap->w;
+		bmap->clip.y2 = bmap->h;
+		if (opts->threads > 1 && pool_init(&pool, opts->threads - 1) == 0) {
+			render_cmds(bmap, &cmds, &pool);
+			pool_destroy(&pool);
+		} else {
+			render_cmds(bmap, &cmds, NULL);
+		}
+	}
+
+	cmd_list_free(&cmds);
+	if (err) {
+		free(bmap);
+		return NULL;
+	}
+	return bmap;
+}
+
+/* script_render() for the script or display list read from 'fp' */
+struct bitmap *script_render_file(FILE *fp, const struct render_opts *opts)
+{
+	struct script_buf sb;
+	struct bitmap *bmap;
+
+	if (script_load(fp, &sb) != 0)
+		return NULL;
+	bmap = script_render(sb.data, sb.len, opts);
+	script_release(&sb);
+
+	return bmap;
+}
+
+/* Parses the dimensions line and all commands of 'sb' into 'cmds'. Empty
+ * lines and lines starting with '#' are skipped; lines before the
+ * dimensions that don't contain two integers are ignored. Only the
+ * dimensions of 'bmap' are set; the canvas is not allocated.
+ *
+ * Returns 0 on success, non-zero on error (a message including the line
+ * number is printed for syntax errors).
+ */
+static int parse_script(const struct script_buf *sb, struct bitmap *bmap,
+		struct cmd_list *cmds)
+{
+	const char *p = sb->data;
+	const char *end = sb->data + sb->len;
+	unsigned long line = 0;
+	int have_dims = 0;
+
+	while (p < end) {
+		const char *eol, *s, *word;
+		const struct cmd_def *def;
+		struct lexer lx;
+		struct cmd cmd;
+		size_t len;
+		int err = 0;
+
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		line++;
+
+		for (s = p; s < eol && isspace((unsigned char)*s); s++)
+			;
+		lx.p = s;
+		lx.eol = eol;
+		p = eol + 1;
+
+		if (s == eol || *s == '#')
+			continue;	// skip empty lines and comments
+
+		if (!have_dims) {
+			if (lex_int(&lx, &bmap->w) && lex_int(&lx, &bmap->h)) {
+				if (bmap->w < 0 || bmap->h < 0)
+					return 1;
+				have_dims = 1;
+			}
+			continue;
+		}
+
+		len = lex_word(&lx, &word);
+		if ((def = cmd_lookup(word, len)) == NULL
+				|| (err = parse_cmd(&lx, def, &cmd, cmds)) > 0) {
+			script_error(sb, "Syntax error, line %lu: \"%.*s\"\n", line,
+					(int)(eol - s + (eol < end)), s);
+			return 1;
+		}
+
+		if (err < 0 || cmd_list_push(cmds, &cmd) != 0) {
+			fputs("ERROR: Could not allocate memory for commands\n",
+					stderr);
+			return 1;
+		}
+	}
+
+	return have_dims ? 0 : 1;
+}
+
+/* Commands are found by switching on their length and first character, so
+ * that each line costs at most one memcmp() against a single candidate.
+ */
+#define CMD_KEY(len, c) ((len) << 8 | (c))
+
+static const struct cmd_def *cmd_lookup(const char *s, size_t len)
+{
+	static const struct cmd_def cmdlist[] = {
+		{ "point",   CMD_POINT,   2 },	/* 0 */
+		{ "line",    CMD_LINE,    4 },	/* 1 */
+		{ "bline",   CMD_LINE,    4 },	/* 2 */
+		{ "rect",    CMD_RECT,    4 },	/* 3 */
+		{ "circle",  CMD_CIRCLE,  3 },	/* 4 */
+		{ "ellipse", CMD_ELLIPSE, 4 },	/* 5 */
+		{ "fill",    CMD_FILL,    2 },	/* 6 */
+		{ "fcircle", CMD_FCIRCLE, 3 },	/* 7 */
+		{ "fellipse", CMD_FELLIPSE, 4 },	/* 8 */
+		{ "smartfill", CMD_SMARTFILL, 3 },	/* 9 */
+		{ "polyline", CMD_POLYLINE, -1 },	/* 10 */
+		{ "polygon", CMD_POLYGON, -1 }	/* 11 */
+	};
+	const struct cmd_def *def;
+
+	if (len == 0 || len > 255)
+		return NULL;
+
+	switch (CMD_KEY(len, (unsigned char)s[0])) {
+	case CMD_KEY(5, 'p'): def = &cmdlist[0]; break;
+	case CMD_KEY(4, 'l'): def = &cmdlist[1]; break;
+	case CMD_KEY(5, 'b'): def = &cmdlist[2]; break;
+	case CMD_KEY(4, 'r'): def = &cmdlist[3]; break;
+	case CMD_KEY(6, 'c'): def = &cmdlist[4]; break;
+	case CMD_KEY(7, 'e'): def = &cmdlist[5]; break;
+	case CMD_KEY(4, 'f'): def = &cmdlist[6]; break;
+	case CMD_KEY(7, 'f'): def = &cmdlist[7]; break;
+	case CMD_KEY(8, 'f'): def = &cmdlist[8]; break;
+	case CMD_KEY(9, 's'): def = &cmdlist[9]; break;
+	case CMD_KEY(8, 'p'): def = &cmdlist[10]; break;
+	case CMD_KEY(7, 'p'): def = &cmdlist[11]; break;
+	default:
+		return NULL;
+	}
+
+	return memcmp(def->str, s, len) == 0 ? def : NULL;
+}
+
+/* Parses "r g b [a] args..." for the command 'def'. The alpha component is
+ * optional and recognised by the number of integers on the line. Vertex
+ * lists are appended to the pool of 'cmds'.
+ *
+ * Returns 0 on success, 1 on a syntax error or -1 if memory ran out.
+ */
+static int parse_cmd(struct lexer *lx, const struct cmd_def *def, struct cmd *cmd,
+		struct cmd_list *cmds)
+{
+	struct rgb255 c;
+	int v[5] = { 0 }, i, n, alpha = 255;
+
+	if (!lex_int(lx, &c.r) || !lex_int(lx, &c.g) || !lex_int(lx, &c.b))
+		return 1;
+
+	if (def->nargs < 0) {
+		size_t first = cmds->n_verts;
+
+		for (n = 0; lex_int(lx, &v[0]); n++)
+			if (cmd_list_push_vert(cmds, v[0]) != 0)
+				return -1;
+		if (n % 2) {	/* "row col" pairs, so the first is the alpha */
+			alpha = cmds->verts[first];
+			memmove(cmds->verts + first, cmds->verts + first + 1,
+					--n * sizeof *cmds->verts);
+			cmds->n_verts--;
+		}
+		if (n == 0 || first > INT_MAX)
+			return 1;
+		cmd->id = def->id;
+		cmd->colour = fromRGBA(&c, alpha);
+		cmd->args[0] = first;
+		cmd->args[1] = n / 2;
+		cmd->args[2] = cmd->args[3] = 0;
+		return 0;
+	}
+
+	for (n = 0; n <= def->nargs && lex_int(lx, &v[n]); n++)
+		;
+	if (n < def->nargs)
+		return 1;
+	if (n > def->nargs)
+		alpha = v[0];
+	for (i = 0; i < def->nargs; i++)
+		cmd->args[i] = v[n - def->nargs + i];
+
+	cmd->id = def->id;
+	cmd->colour = fromRGBA(&c, alpha);
+
+	return 0;
+}
+
+/* Draws 'cmd'; 'verts' is the vertex pool of its list */
+static void cmd_exec(const struct cmd *cmd, const int *verts,
+		const struct bitmap *bmap)
+{
+	const int *a = cmd->args;
+	uint32_t c = cmd->colour;
+	struct point2d p1, p2;
+
+	p1.y = a[0];
+	p1.x = a[1];
+
+	switch (cmd->id) {
+	case CMD_POINT:
+		draw_point(bmap, c, &p1);
+		break;
+	case CMD_LINE:
+		p2.y = a[2];
+		p2.x = a[3];
+		draw_line(bmap, c, &p1, &p2);
+		break;
+	case CMD_RECT:
+		p2.y = p1.y + a[2];
+		p2.x = p1.x + a[3];
+		draw_rect(bmap, c, &p1, &p2);
+		break;
+	case CMD_CIRCLE:
+		draw_circle(bmap, c, &p1, a[2]);
+		break;
+	case CMD_ELLIPSE:
+		draw_ellipse(bmap, c, &p1, a[3], a[2]);
+		break;
+	case CMD_FILL:
+		draw_fill(bmap, c, &p1);
+		break;
+	case CMD_SMARTFILL:
+		draw_smartfill(bmap, c, &p1, a[2]);
+		break;
+	case CMD_FCIRCLE:
+		draw_fcircle(bmap, c, &p1, a[2]);
+		break;
+	case CMD_FELLIPSE:
+		draw_fellipse(bmap, c, &p1, a[3], a[2]);
+		break;
+	case CMD_POLYLINE:
+		draw_polyline(bmap, c, verts + a[0], a[1]);
+		break;
+	case CMD_POLYGON:
+		draw_polygon(bmap, c, verts + a[0], a[1]);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Fills read pixels that other commands wrote and may spread anywhere, so
+ * they can't be binned and have to run on their own.
+ */
+static int cmd_is_barrier(const struct cmd *cmd)
+{
+	return cmd->id == CMD_FILL || cmd->id == CMD_SMARTFILL;
+}
+
+/* Computes a bounding box of every pixel 'cmd' may draw, intersected with
+ * 'clip'. Returns 0 if the intersection is empty (the command draws
+ * nothing), 1 otherwise. Not meaningful for barrier commands.
+ */
+static int cmd_bbox(const struct cmd *cmd, const int *verts,
+		const struct rect *clip, struct rect *r)
+{
+	const int *a = cmd->args;
+	long long x1, y1, x2, y2, rx, ry;
+	int i;
+
+	switch (cmd->id) {
+	case CMD_POINT:
+		x1 = x2 = a[1];
+		y1 = y2 = a[0];
+		break;
+	case CMD_LINE:
+		x1 = a[1] < a[3] ? a[1] : a[3];
+		x2 = a[1] < a[3] ? a[3] : a[1];
+		y1 = a[0] < a[2] ? a[0] : a[2];
+		y2 = a[0] < a[2] ? a[2] : a[0];
+		break;
+	case CMD_RECT:		/* rows y..y+h-1, columns x..x+w */
+		x1 = (long long)a[1] + (a[3] < 0 ? a[3] : 0);
+		x2 = (long long)a[1] + (a[3] < 0 ? 0 : a[3]);
+		y1 = (long long)a[0] + (a[2] < 0 ? a[2] : 0);
+		y2 = (long long)a[0] + (a[2] < 0 ? 0 : a[2]) - 1;
+		break;
+	case CMD_CIRCLE:
+	case CMD_FCIRCLE:
+		rx = ry = llabs(a[2]);
+		goto conic;
+	case CMD_ELLIPSE:
+	case CMD_FELLIPSE:
+		rx = llabs(a[3]) + 1;
+		ry = llabs(a[2]) + 1;
+	conic:
+		x1 = a[1] - rx;
+		x2 = a[1] + rx;
+		y1 = a[0] - ry;
+		y2 = a[0] + ry;
+		break;
+	case CMD_POLYLINE:
+	case CMD_POLYGON:
+		x1 = x2 = verts[a[0] + 1];
+		y1 = y2 = verts[a[0]];
+		for (i = 1; i < a[1]; i++) {
+			const int *v = verts + a[0] + 2 * i;
+
+			x1 = v[1] < x1 ? v[1] : x1;
+			x2 = v[1] > x2 ? v[1] : x2;
+			y1 = v[0] < y1 ? v[0] : y1;
+			y2 = v[0] > y2 ? v[0] : y2;
+		}
+		break;
+	default:
+		x1 = clip->x1;
+		y1 = clip->y1;
+		x2 = clip->x2 - 1;
+		y2 = clip->y2 - 1;
+		break;
+	}
+
+	r->x1 = x1 > clip->x1 ? x1 : clip->x1;
+	r->y1 = y1 > clip->y1 ? y1 : clip->y1;
+	r->x2 = x2 + 1 < clip->x2 ? x2 + 1 : clip->x2;
+	r->y2 = y2 + 1 < clip->y2 ? y2 + 1 : clip->y2;
+
+	return r->x1 < r->x2 && r->y1 < r->y2;
+}
+
+
+/***************************************************************************
+ * Rendering
+ ***************************************************************************/
+
+static void render_cmds(const struct bitmap *bmap, const struct cmd_list *cmds,
+		struct thread_pool *pool)
+{
+	struct render_stats *st = bmap->stats;
+	size_t i;
+
+	if (pool && render_tiled(bmap, cmds, pool) == 0)
+		return;
+
+	if (st) {
+		for (i = 0; i < cmds->n; i++) {
+			const struct cmd *cmd = &cmds->cmds[i];
+			double t0 = clock_seconds();
+
+			cmd_exec(cmd, cmds->verts, bmap);
+			st->cmd_time[cmd->id] += clock_seconds() - t0;
+			st->cmd_count[cmd->id]++;
+		}
+		return;
+	}
+
+	for (i = 0; i < cmds->n; i++)
+		cmd_exec(&cmds->cmds[i], cmds->verts, bmap);
+}
+
+/* Renders 'cmds' by binning them into TILE_SZ x TILE_SZ screen tiles and
+ * letting the pool rasterize tiles in parallel. Every tile replays its
+ * commands in script order through a bitmap clipped to the tile, and all
+ * primitives draw exactly the same pixels when clipped, so the result is
+ * identical to drawing serially. Barrier commands (fills) split the script
+ * into batches and run on their own between them.
+ *
+ * Returns 0 on success or -1 if memory for the bins could not be allocated
+ * (nothing has been drawn in that case).
+ */
+static int render_tiled(const struct bitmap *bmap, const struct cmd_list *cmds,
+		struct thread_pool *pool)
+{
+	struct tile_job job;
+	struct rect r;
+	size_t *bin_start, *bin_pos;
+	uint32_t *bins;
+	size_t first, last, i, n_binned;
+	int tx, ty, t, tiles_x, tiles_y, n_tiles, oversized;
+
+	tiles_x = (bmap->w + TILE_SZ - 1) / TILE_SZ;
+	tiles_y = (bmap->h + TILE_SZ - 1) / TILE_SZ;
+	n_tiles = tiles_x * tiles_y;
+
+	bin_start = malloc((n_tiles + 1) * sizeof *bin_start);
+	bin_pos = malloc((n_tiles + 1) * sizeof *bin_pos);
+	bins = malloc(TILE_MAX_BINNED * sizeof *bins);
+	if (!bin_start || !bin_pos || !bins) {
+		free(bin_start);
+		free(bin_pos);
+		free(bins);
+		return -1;
+	}
+
+	job.bmap = bmap;
+	job.verts = cmds->verts;
+	job.bins = bins;
+	job.bin_start = bin_start;
+	job.tiles_x = tiles_x;
+	job.n_tiles = n_tiles;
+	pthread_mutex_init(&job.lock, NULL);
+
+	for (first = 0; first < cmds->n; first = last) {
+		if (cmd_is_barrier(&cmds->cmds[first])) {
+			cmd_exec(&cmds->cmds[first], cmds->verts, bmap);
+			last = first + 1;
+			continue;
+		}
+
+		/* Count the entries of each tile for the longest run of commands
+		 * that has no barrier and fits in 'bins'
+		 */
+		memset(bin_start, 0, (n_tiles + 1) * sizeof *bin_start);
+		n_binned = 0;
+		oversized = 0;
+		for (last = first; last < cmds->n; last++) {
+			const struct cmd *cmd = &cmds->cmds[last];
+			size_t n;
+
+			if (cmd_is_barrier(cmd) || last - first >= UINT32_MAX)
+				break;
+			if (!cmd_bbox(cmd, cmds->verts, &bmap->clip, &r))
+				continue;
+			n = (size_t)((r.x2 - 1) / TILE_SZ - r.x1 / TILE_SZ + 1)
+				* ((r.y2 - 1) / TILE_SZ - r.y1 / TILE_SZ + 1);
+			if (n_binned + n > TILE_MAX_BINNED) {
+				/* A single command covering more tiles than fit is drawn
+				 * on its own
+				 */
+				oversized = last == first;
+				break;
+			}
+			n_binned += n;
+			for (ty = r.y1 / TILE_SZ; ty <= (r.y2 - 1) / TILE_SZ; ty++)
+				for (tx = r.x1 / TILE_SZ; tx <= (r.x2 - 1) / TILE_SZ; tx++)
+					bin_start[ty * tiles_x + tx + 1]++;
+		}
+
+		if (oversized) {
+			cmd_exec(&cmds->cmds[first], cmds->verts, bmap);
+			last = first + 1;
+			continue;
+		}
+
+		for (t = 0; t < n_tiles; t++) {
+			bin_start[t + 1] += bin_start[t];
+			bin_pos[t] = bin_start[t];
+		}
+
+		for (i = first; i < last; i++) {
+			const struct cmd *cmd = &cmds->cmds[i];
+
+			if (!cmd_bbox(cmd, cmds->verts, &bmap->clip, &r))
+				continue;
+			for (ty = r.y1 / TILE_SZ; ty <= (r.y2 - 1) / TILE_SZ; ty++)
+				for (tx = r.x1 / TILE_SZ; tx <= (r.x2 - 1) / TILE_SZ; tx++)
+					bins[bin_pos[ty * tiles_x + tx]++] = i - first;
+		}
+
+		if (n_binned) {
+			job.cmds = cmds->cmds + first;
+			job.next_tile = 0;
+			pool_run(pool, render_tile_worker, &job);
+		}
+	}
+
+	pthread_mutex_destroy(&job.lock);
+	free(bin_start);
+	free(bin_pos);
+	free(bins);
+
+	return 0;
+}
+
+static void render_tile_worker(void *arg)
+{
+	struct tile_job *job = arg;
+	struct bitmap view = *job->bmap;
+	const struct rect *clip = &job->bmap->clip;
+	size_t i;
+	int t;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		t = job->next_tile++;
+		pthread_mutex_unlock(&job->lock);
+
+		if (t >= job->n_tiles)
+			break;
+		if (job->bin_start[t] == job->bin_start[t + 1])
+			continue;
+
+		view.clip.x1 = (t % job->tiles_x) * TILE_SZ;
+		view.clip.y1 = (t / job->tiles_x) * TILE_SZ;
+		view.clip.x2 = view.clip.x1 + TILE_SZ;
+		view.clip.y2 = view.clip.y1 + TILE_SZ;
+		if (view.clip.x1 < clip->x1)
+			view.clip.x1 = clip->x1;
+		if (view.clip.y1 < clip->y1)
+			view.clip.y1 = clip->y1;
+		if (view.clip.x2 > clip->x2)
+			view.clip.x2 = clip->x2;
+		if (view.clip.y2 > clip->y2)
+			view.clip.y2 = clip->y2;
+
+		for (i = job->bin_start[t]; i < job->bin_start[t + 1]; i++)
+			cmd_exec(&job->cmds[job->bins[i]], job->verts, &view);
+	}
+}
+
+
+/* Renders 'cmds' (which must not contain barriers) and writes the image to
+ * 'fpo' one band of 'band_rows' rows at a time, so only a band_rows x w
+ * buffer is held and output starts after the first band. Commands are
+ * sorted by their first row and kept in an active list, in script order,
+ * while their bounding boxes overlap the current band; the band is drawn
+ * through a bitmap clipped to its rows, which gives the same pixels as
+ * drawing the whole canvas.
+ *
+ * Returns 0 on success, non-zero on error.
+ */
+static int render_banded(FILE *fpo, const struct bitmap *bmap,
+		const struct cmd_list *cmds, int band_rows,
+		enum image_format format)
+{
+	struct bitmap band = *bmap;
+	struct band_ref *refs, *active;
+	struct rect r;
+	uint32_t *buff;
+	size_t n_refs = 0, next = 0, n_active, i, j;
+	int y0, rows, err = 0;
+
+	ppm_write_header(fpo, format, bmap->w, bmap->h);
+	if (bmap->h == 0)
+		return 0;
+	if (band_rows > bmap->h)
+		band_rows = bmap->h;
+
+	refs = malloc((cmds->n + 1) * sizeof *refs);
+	active = malloc((cmds->n + 1) * sizeof *active);
+	buff = malloc(((size_t)bmap->w * band_rows + 1) * sizeof *buff);
+	if (!refs || !active || !buff) {
+		fputs("ERROR: Could not allocate memory for bands\n", stderr);
+		free(refs);
+		free(active);
+		free(buff);
+		return 1;
+	}
+
+	for (i = 0; i < cmds->n; i++) {
+		if (cmd_bbox(&cmds->cmds[i], cmds->verts, &bmap->clip, &r)) {
+			refs[n_refs].idx = i;
+			refs[n_refs].y1 = r.y1;
+			refs[n_refs].y2 = r.y2;
+			n_refs++;
+		}
+	}
+	qsort(refs, n_refs, sizeof *refs, band_ref_cmp_y);
+
+	n_active = 0;
+	for (y0 = 0; y0 < bmap->h && !err; y0 += rows) {
+		rows = bmap->h - y0 < band_rows ? bmap->h - y0 : band_rows;
+
+		/* retire commands above the band, then add the ones starting
+		 * in it and restore script order
+		 */
+		for (i = j = 0; i < n_active; i++)
+			if (active[i].y2 > y0)
+				active[j++] = active[i];
+		n_active = j;
+		for (j = n_active; next < n_refs && refs[next].y1 < y0 + rows; next++)
+			active[n_active++] = refs[next];
+		if (n_active > j)
+			qsort(active, n_active, sizeof *active, band_ref_cmp_idx);
+
+		/* rows y0.. map to the start of the buffer */
+		band.data = buff;
+		band.y_origin = y0;
+		band.clip.y1 = y0;
+		band.clip.y2 = y0 + rows;
+		memset(buff, 0, (size_t)bmap->w * rows * sizeof *buff);
+
+		for (i = 0; i < n_active; i++)
+			cmd_exec(&cmds->cmds[active[i].idx], cmds->verts, &band);
+
+		if (ppm_write_rows(fpo, format, buff, bmap->w, rows) != 0)
+			err = 1;
+	}
+
+	free(refs);
+	free(active);
+	free(buff);
+
+	return err;
+}
+
+
+/***************************************************************************
+ * Overdraw culling
+ ***************************************************************************/
+
+/* Removes the commands of 'cmds' whose pixels are all painted over by
+ * later opaque commands, and cuts rects down to the rows and columns that
+ * stay visible. The script is walked backwards while the area covered by
+ * opaque rects, fcircles and fellipses is collected per row; a command is
+ * dropped if its exact pixels (for those shapes) or its bounding box (for
+ * the others) lie inside that area. Translucent commands are culled the
+ * same way but don't cover anything. Fills read the canvas, so coverage
+ * starts over at each of them. The image doesn't change.
+ *
+ * Returns 0 on success, non-zero if memory ran out ('cmds' is unchanged).
+ */
+static int cull_cmds(const struct bitmap *bmap, struct cmd_list *cmds,
+		struct render_stats *st)
+{
+	struct cmd_list out = { 0, 0, NULL, NULL, 0, 0 };
+	struct coverage cov;
+	struct rect clip, r;
+	size_t i;
+	int y, err = 0;
+
+	if (cover_init(&cov, bmap->w, bmap->h) != 0)
+		return 1;
+	clip.x1 = clip.y1 = 0;
+	clip.x2 = bmap->w;
+	clip.y2 = bmap->h;
+
+	for (i = cmds->n; i-- > 0 && !err; ) {
+		const struct cmd *cmd = &cmds->cmds[i];
+
+		if (cmd_is_barrier(cmd)) {
+			cover_reset(&cov);
+			err = cmd_list_push(&out, cmd);
+			continue;
+		}
+
+		switch (cmd->id) {
+		case CMD_RECT:
+			err = cull_rect(&cov, cmd, &out, st);
+			break;
+		case CMD_FCIRCLE:
+		case CMD_FELLIPSE:
+			err = cull_conic(&cov, cmd, &out, st);
+			break;
+		default:
+			if (cmd_bbox(cmd, cmds->verts, &clip, &r)) {
+				for (y = r.y1; y < r.y2; y++)
+					if (cover_gap(&cov, y, r.x1, r.x2, NULL, NULL))
+						break;
+				if (y < r.y2) {
+					err = cmd_list_push(&out, cmd);
+					break;
+				}
+			}
+			st->n_culled++;
+			break;
+		}
+	}
+	cover_free(&cov);
+
+	if (err) {
+		cmd_list_free(&out);
+		return 1;
+	}
+
+	/* back to script order */
+	for (i = 0; i < out.n / 2; i++)
+		SWAP(struct cmd, out.cmds[i], out.cmds[out.n - 1 - i]);
+	free(cmds->cmds);
+	cmds->cmds = out.cmds;
+	cmds->n = out.n;
+	cmds->max_elems = out.max_elems;
+
+	return 0;
+}
+
+/* Culls the rect 'cmd': pushes the parts of it that aren't covered to
+ * 'out' (one rect per run of rows with uncovered pixels, as narrow as the
+ * uncovered columns of those rows allow), then adds it to the coverage.
+ */
+static int cull_rect(struct coverage *cov, const struct cmd *cmd,
+		struct cmd_list *out, struct render_stats *st)
+{
+	struct rect clip, r;
+	struct cmd piece = *cmd;
+	long long area, kept = 0;
+	size_t n_pieces = 0;
+	int y, run = -1, run_lo = 0, run_hi = 0, lo, hi, gap;
+
+	clip.x1 = clip.y1 = 0;
+	clip.x2 = cov->w;
+	clip.y2 = cov->h;
+	if (!cmd_bbox(cmd, NULL, &clip, &r)) {
+		st->n_culled++;
+		return 0;
+	}
+	area = (long long)(r.x2 - r.x1) * (r.y2 - r.y1);
+
+	for (y = r.y1; y <= r.y2; y++) {
+		gap = y < r.y2 && cover_gap(cov, y, r.x1, r.x2, &lo, &hi);
+		if (gap && run < 0) {
+			run = y;
+			run_lo = lo;
+			run_hi = hi;
+		} else if (gap) {
+			run_lo = lo < run_lo ? lo : run_lo;
+			run_hi = hi > run_hi ? hi : run_hi;
+		} else if (run >= 0) {
+			/* rows run..y-1, columns run_lo..run_hi-1 */
+			piece.args[0] = run;
+			piece.args[1] = run_lo;
+			piece.args[2] = y - run;
+			piece.args[3] = run_hi - run_lo - 1;
+			kept += (long long)(run_hi - run_lo) * (y - run);
+			n_pieces++;
+			if (kept < area && cmd_list_push(out, &piece) != 0)
+				return 1;
+			run = -1;
+		}
+	}
+
+	if (kept == area) {
+		if (cmd_list_push(out, cmd) != 0)	/* untouched */
+			return 1;
+	} else {
+		st->pixels_culled += area - kept;
+		if (n_pieces == 0)
+			st->n_culled++;
+		else
+			st->n_trimmed++;
+	}
+
+	if (cmd->colour >> 24 == 0)
+		for (y = r.y1; y < r.y2; y++)
+			if (cover_add(cov, y, r.x1, r.x2) != 0)
+				return 1;
+
+	return 0;
+}
+
+/* Culls the fcircle or fellipse 'cmd' if every one of its spans is
+ * covered, then adds the spans to the coverage.
+ */
+static int cull_conic(struct coverage *cov, const struct cmd *cmd,
+		struct cmd_list *out, struct render_stats *st)
+{
+	const int *a = cmd->args;
+	long long area = 0, x1, x2;
+	int *hw, ry = a[2], y, y1, y2, d1, d2, covered = 1, err = 0;
+
+	if (ry < 0 || (cmd->id == CMD_FELLIPSE && a[3] < 0)
+			|| !mirrored_rows(0, cov->h, a[0], ry, &d1, &d2)) {
+		st->n_culled++;		/* draws nothing */
+		return 0;
+	}
+	if (cmd->id == CMD_FCIRCLE)
+		hw = fcircle_rows(ry, d1, d2);
+	else
+		hw = fellipse_rows(a[3], ry, d1, d2);
+	if (hw == NULL)
+		return cmd_list_push(out, cmd);
+
+	y1 = (long long)a[0] - ry > 0 ? a[0] - ry : 0;
+	y2 = (long long)a[0] + ry + 1 < cov->h ? a[0] + ry + 1 : cov->h;
+	for (y = y1; y < y2; y++) {
+		int d = y > a[0] ? y - a[0] : a[0] - y;
+
+		x1 = (long long)a[1] - hw[d - d1];
+		x2 = (long long)a[1] + hw[d - d1] + 1;
+		x1 = x1 > 0 ? x1 : 0;
+		x2 = x2 < cov->w ? x2 : cov->w;
+		if (x1 >= x2)
+			continue;
+		area += x2 - x1;
+		if (covered && cover_gap(cov, y, x1, x2, NULL, NULL))
+			covered = 0;
+	}
+
+	if (covered) {
+		st->n_culled++;
+		st->pixels_culled += area;
+	} else {
+		err = cmd_list_push(out, cmd);
+	}
+
+	if (cmd->colour >> 24 == 0) {
+		for (y = y1; y < y2 && !err; y++) {
+			int d = y > a[0] ? y - a[0] : a[0] - y;
+
+			x1 = (long long)a[1] - hw[d - d1];
+			x2 = (long long)a[1] + hw[d - d1] + 1;
+			x1 = x1 > 0 ? x1 : 0;
+			x2 = x2 < cov->w ? x2 : cov->w;
+			if (x1 < x2)
+				err = cover_add(cov, y, x1, x2);
+		}
+	}
+
+	free(hw);
+	return err;
+}
+
+static int cover_init(struct coverage *cov, int w, int h)
+{
+	cov->w = w;
+	cov->h = h;
+	cov->full_rows = 0;
+	cov->n_dirty = 0;
+	cov->rows = calloc((size_t)h + 1, sizeof *cov->rows);
+	cov->dirty = malloc(((size_t)h + 1) * sizeof *cov->dirty);
+	if (!cov->rows || !cov->dirty) {
+		free(cov->rows);
+		free(cov->dirty);
+		return 1;
+	}
+	return 0;
+}
+
+static void cover_free(struct coverage *cov)
+{
+	int y;
+
+	for (y = 0; y < cov->h; y++)
+		free(cov->rows[y].iv);
+	free(cov->rows);
+	free(cov->dirty);
+}
+
+/* Forgets all coverage; the interval arrays are kept for reuse */
+static void cover_reset(struct coverage *cov)
+{
+	while (cov->n_dirty > 0)
+		cov->rows[cov->dirty[--cov->n_dirty]].n = 0;
+	cov->full_rows = 0;
+}
+
+/* Adds [x1, x2) (within 0..w) on row 'y', merging it with the intervals it
+ * overlaps or touches. Returns non-zero if memory ran out.
+ */
+static int cover_add(struct coverage *cov, int y, int x1, int x2)
+{
+	struct cover_row *row = &cov->rows[y];
+	int k, m, full;
+
+	full = row->n == 1 && row->iv[0] == 0 && row->iv[1] == cov->w;
+	if (full)
+		return 0;
+
+	k = cover_search(row, 1, x1 - 1);	/* first ending at or after x1 */
+	m = cover_search(row, 0, x2);		/* first starting after x2 */
+	if (k < m) {
+		x1 = row->iv[2 * k] < x1 ? row->iv[2 * k] : x1;
+		x2 = row->iv[2 * m - 1] > x2 ? row->iv[2 * m - 1] : x2;
+	} else if (row->n == row->max) {
+		int sz = row->max ? row->max * 2 : 4;
+		int *tmp;
+
+		if ((tmp = realloc(row->iv, 2 * (size_t)sz * sizeof *tmp)) == NULL)
+			return 1;
+		row->iv = tmp;
+		row->max = sz;
+	}
+	if (row->n == 0)
+		cov->dirty[cov->n_dirty++] = y;
+
+	/* replace intervals k..m-1 (possibly none) by [x1, x2) */
+	memmove(row->iv + 2 * (k + 1), row->iv + 2 * m,
+			2 * (size_t)(row->n - m) * sizeof *row->iv);
+	row->n += 1 - (m - k);
+	row->iv[2 * k] = x1;
+	row->iv[2 * k + 1] = x2;
+
+	if (row->n == 1 && x1 == 0 && x2 == cov->w)
+		cov->full_rows++;
+	return 0;
+}
+
+/* Returns 0 if [x1, x2) is covered on row 'y'. Otherwise returns 1 and, if
+ * they are not NULL, sets [*lo, *hi) to the span from the first to the last
+ * uncovered pixel.
+ */
+static int cover_gap(const struct coverage *cov, int y, int x1, int x2,
+		int *lo, int *hi)
+{
+	const struct cover_row *row = &cov->rows[y];
+	int k;
+
+	if (cov->full_rows == cov->h)
+		return 0;
+
+	k = cover_search(row, 1, x1);		/* first ending after x1 */
+	if (k < row->n && row->iv[2 * k] <= x1) {
+		if (row->iv[2 * k + 1] >= x2)
+			return 0;
+		x1 = row->iv[2 * k + 1];
+	}
+	if (lo) {
+		k = cover_search(row, 0, x2 - 1) - 1;	/* last starting before x2 */
+		if (k >= 0 && row->iv[2 * k + 1] >= x2)
+			x2 = row->iv[2 * k];
+		*lo = x1;
+		*hi = x2;
+	}
+	return 1;
+}
+
+/* Returns the first interval of 'row' whose start (which = 0) or end
+ * (which = 1) is greater than 'x', or row->n
+ */
+static int cover_search(const struct cover_row *row, int which, int x)
+{
+	int lo = 0, hi = row->n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (row->iv[2 * mid + which] > x)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+
+/***************************************************************************
+ * Statistics
+ ***************************************************************************/
+
+/* Writes 'st' as a text report to stderr, or as a JSON object to 'path' if
+ * it is not NULL. Returns 0 on success, non-zero if 'path' could not be
+ * written.
+ */
+static int stats_report(const char *path, const struct render_stats *st)
+{
+	static const char *const names[CMD_COUNT] = {
+		"point", "line", "rect", "circle", "ellipse", "fill",
+		"fcircle", "fellipse", "smartfill", "polyline", "polygon"
+	};
+	FILE *fp = stderr;
+	int id, first = 1, err;
+
+	if (path == NULL) {
+		fprintf(fp, "stats: phase     ms\n");
+		fprintf(fp, "stats:   parse   %10.3f  (%lu bytes, %lu commands)\n",
+				st->t_parse * 1e3, (unsigned long)st->input_bytes,
+				(unsigned long)st->n_cmds);
+		fprintf(fp, "stats:   cull    %10.3f  (%lu commands dropped,"
+				" %lu trimmed, %llu pixels)\n", st->t_cull * 1e3,
+				(unsigned long)st->n_culled, (unsigned long)st->n_trimmed,
+				st->pixels_culled);
+		fprintf(fp, "stats:   cache   %10.3f  (%lu commands restored)\n",
+				st->t_cache * 1e3, (unsigned long)st->n_cached);
+		fprintf(fp, "stats:   render  %10.3f\n", st->t_render * 1e3);
+		fprintf(fp, "stats:   encode  %10.3f\n", st->t_encode * 1e3);
+		fprintf(fp, "stats: command   calls        ms\n");
+		for (id = 0; id < CMD_COUNT; id++)
+			if (st->cmd_count[id])
+				fprintf(fp, "stats:   %-9s %7lu %10.3f\n", names[id],
+						st->cmd_count[id], st->cmd_time[id] * 1e3);
+		fprintf(fp, "stats: pixels written %llu, clipped %llu\n",
+				st->pixels_written, st->pixels_clipped);
+		fprintf(fp, "stats: fill stack high-water mark %lu spans\n",
+				(unsigned long)st->fill_max_depth);
+		return 0;
+	}
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		perror(path);
+		return 1;
+	}
+
+	fprintf(fp, "{\n  \"phases_ms\": {\"parse\": %.3f, \"cull\": %.3f,"
+			" \"cache\": %.3f, \"render\": %.3f, \"encode\": %.3f},\n",
+			st->t_parse * 1e3, st->t_cull * 1e3, st->t_cache * 1e3,
+			st->t_render * 1e3, st->t_encode * 1e3);
+	fprintf(fp, "  \"input_bytes\": %lu,\n  \"commands\": %lu,\n"
+			"  \"commands_culled\": %lu,\n  \"commands_trimmed\": %lu,\n"
+			"  \"pixels_culled\": %llu,\n  \"commands_cached\": %lu,\n",
+			(unsigned long)st->input_bytes, (unsigned long)st->n_cmds,
+			(unsigned long)st->n_culled, (unsigned long)st->n_trimmed,
+			st->pixels_culled, (unsigned long)st->n_cached);
+	fputs("  \"per_command\": {", fp);
+	for (id = 0; id < CMD_COUNT; id++) {
+		if (!st->cmd_count[id])
+			continue;
+		fprintf(fp, "%s\n    \"%s\": {\"calls\": %lu, \"ms\": %.3f}",
+				first ? "" : ",", names[id], st->cmd_count[id],
+				st->cmd_time[id] * 1e3);
+		first = 0;
+	}
+	fprintf(fp, "%s},\n", first ? "" : "\n  ");
+	fprintf(fp, "  \"pixels_written\": %llu,\n  \"pixels_clipped\": %llu,\n"
+			"  \"fill_stack_max_depth\": %lu\n}\n",
+			st->pixels_written, st->pixels_clipped,
+			(unsigned long)st->fill_max_depth);
+
+	err = ferror(fp);
+	if (fclose(fp) != 0 || err) {
+		perror(path);
+		return 1;
+	}
+	return 0;
+}
+
+
+/***************************************************************************
+ * Batch rendering
+ ***************************************************************************/
+
+/* Renders every job listed in 'manifest', one "input output" pair of file
+ * names per line ('#' starts a comment line). Jobs run opts->threads at a
+ * time, each on a single thread; every worker keeps its canvas buffer for
+ * the next job. Errors are reported per job and don't stop the batch.
+ *
+ * Returns 0 if every job succeeded, 1 otherwise.
+ */
+int batch_run(const char *manifest, const struct render_opts *opts)
+{
+	struct script_buf sb;
+	struct render_opts job_opts = *opts;
+	struct batch b;
+	struct thread_pool pool;
+	const char *p, *end, *eol;
+	unsigned long line = 0;
+	size_t max_jobs = 0;
+	double t0 = clock_seconds();
+	FILE *fp;
+	int err = 0;
+
+	if ((fp = fopen(manifest, "r")) == NULL) {
+		perror(manifest);
+		return 1;
+	}
+	err = script_load(fp, &sb);
+	fclose(fp);
+	if (err)
+		return 1;
+	sb.name = manifest;
+
+	memset(&b, 0, sizeof b);
+	for (p = sb.data, end = sb.data + sb.len; p < end && !err; p = eol + 1) {
+		struct lexer lx;
+		const char *in, *out;
+		size_t in_len, out_len;
+		char **tmp;
+
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		line++;
+
+		lx.p = p;
+		lx.eol = eol;
+		lex_space(&lx);
+		if ((in_len = lex_word(&lx, &in)) == 0 || *in == '#')
+			continue;
+		lex_space(&lx);
+		out_len = lex_word(&lx, &out);
+		lex_space(&lx);
+		if (out_len == 0 || lx.p != lx.eol) {
+			script_error(&sb, "Line %lu: expected \"input output\"\n",
+					line);
+			err = 1;
+			break;
+		}
+
+		if (b.n == max_jobs) {
+			max_jobs = max_jobs ? max_jobs * 2 : 256;
+			if ((tmp = realloc(b.inputs, max_jobs * sizeof *tmp)) != NULL)
+				b.inputs = tmp;
+			if (tmp && (tmp = realloc(b.outputs, max_jobs * sizeof *tmp)))
+				b.outputs = tmp;
+			if (tmp == NULL) {
+				fputs("ERROR: Could not allocate memory for jobs\n",
+						stderr);
+				err = 1;
+				break;
+			}
+		}
+		b.inputs[b.n] = strndup(in, in_len);
+		b.outputs[b.n] = strndup(out, out_len);
+		b.n++;
+		if (!b.inputs[b.n - 1] || !b.outputs[b.n - 1]) {
+			fputs("ERROR: Could not allocate memory for jobs\n", stderr);
+			err = 1;
+		}
+	}
+	script_release(&sb);
+
+	if (err == 0) {
+		job_opts.threads = 1;
+		job_opts.stats = 0;
+		b.opts = &job_opts;
+		pthread_mutex_init(&b.lock, NULL);
+
+		if (opts->threads > 1 && b.n > 1 && pool_init(&pool,
+				(size_t)opts->threads - 1 < b.n - 1
+				? opts->threads - 1 : (int)(b.n - 1)) == 0) {
+			pool_run(&pool, batch_worker, &b);
+			pool_destroy(&pool);
+		} else {
+			batch_worker(&b);
+		}
+
+		pthread_mutex_destroy(&b.lock);
+		if (opts->verbose)
+			fprintf(stderr, "batch: %lu jobs, %lu failed in %.3f ms\n",
+					(unsigned long)b.n, (unsigned long)b.failed,
+					(clock_seconds() - t0) * 1e3);
+		err = b.failed != 0;
+	}
+
+	while (b.n--) {
+		free(b.inputs[b.n]);
+		free(b.outputs[b.n]);
+	}
+	free(b.inputs);
+	free(b.outputs);
+
+	return err;
+}
+
+
+/***************************************************************************
+ * Render server
+ ***************************************************************************/
+
+static volatile sig_atomic_t serve_stopping;
+
+/* Listens on the Unix socket 'path' and renders each connection as one
+ * job: the client sends a script or display list and shuts down its
+ * sending side, the server streams the image back and closes the
+ * connection (without sending anything if the job failed; the message is
+ * printed on the server's stderr). Accepted connections wait in a bounded
+ * queue for opts->threads workers, each of which keeps its canvas buffer
+ * between jobs; a client that stalls for SERVE_TIMEOUT_S fails its job.
+ * Runs until SIGINT or SIGTERM.
+ *
+ * Returns 0 on a clean shutdown, 1 if the socket could not be set up.
+ */
+int serve(const char *path, const struct render_opts *opts)
+{
+	struct render_opts job_opts = *opts;
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct server srv;
+	sigset_t stop_sigs, wait_sigs;
+	pthread_t *threads;
+	fd_set rfds;
+	int fd, n_threads, i;
+
+	if (unix_address(path, &addr) != 0)
+		return 1;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return 1;
+	}
+	/* refuse to take over the socket of a running server */
+	if (connect(fd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+		fprintf(stderr, "%s: a server is already listening\n", path);
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	if (unix_remove(path) != 0)	/* a stale socket, never a file */
+		return 1;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return 1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof addr) != 0
+			|| listen(fd, SERVE_QUEUE_SZ) != 0
+			|| fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+		perror(path);
+		close(fd);
+		return 1;
+	}
+
+	job_opts.threads = 1;
+	job_opts.stats = 0;
+	memset(&srv, 0, sizeof srv);
+	srv.opts = &job_opts;
+	pthread_mutex_init(&srv.lock, NULL);
+	pthread_cond_init(&srv.not_empty, NULL);
+	pthread_cond_init(&srv.not_full, NULL);
+
+	/* The signals stay blocked except while the main thread waits in
+	 * pselect(), so one arriving between the check of serve_stopping and
+	 * the wait still ends it. Workers inherit the blocked mask.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&stop_sigs);
+	sigaddset(&stop_sigs, SIGINT);
+	sigaddset(&stop_sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_sigs, &wait_sigs);
+	sigdelset(&wait_sigs, SIGINT);
+	sigdelset(&wait_sigs, SIGTERM);
+
+	n_threads = opts->threads > 0 ? opts->threads : 1;
+	if ((threads = malloc(n_threads * sizeof *threads)) == NULL)
+		n_threads = 0;
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&threads[i], NULL, serve_worker, &srv) != 0)
+			break;
+	}
+	n_threads = i;
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = serve_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (n_threads == 0) {
+		fputs("ERROR: Could not start server threads\n", stderr);
+		serve_stopping = 1;
+	} else if (opts->verbose) {
+		fprintf(stderr, "serve: listening on %s with %d workers\n", path,
+				n_threads);
+	}
+
+	while (!serve_stopping) {
+		int client;
+
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+		if (pselect(fd + 1, &rfds, NULL, NULL, NULL, &wait_sigs) < 0) {
+			if (errno != EINTR) {
+				perror("pselect");
+				break;
+			}
+			continue;
+		}
+		if ((client = accept(fd, NULL, NULL)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK
+					&& errno != EINTR && errno != ECONNABORTED)
+				perror("accept");
+			continue;
+		}
+		fcntl(client, F_SETFL, fcntl(client, F_GETFL) & ~O_NONBLOCK);
+
+		/* the workers drain the queue until srv.quit is set */
+		pthread_mutex_lock(&srv.lock);
+		while (srv.count == SERVE_QUEUE_SZ)
+			pthread_cond_wait(&srv.not_full, &srv.lock);
+		srv.queue[(srv.head + srv.count++) % SERVE_QUEUE_SZ] = client;
+		pthread_cond_signal(&srv.not_empty);
+		pthread_mutex_unlock(&srv.lock);
+	}
+
+	/* let the workers finish what was accepted, then stop */
+	pthread_mutex_lock(&srv.lock);
+	srv.quit = 1;
+	pthread_cond_broadcast(&srv.not_empty);
+	pthread_mutex_unlock(&srv.lock);
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	close(fd);
+	unix_remove(path);
+	if (opts->verbose)
+		fprintf(stderr, "serve: stopped after %lu requests\n", srv.served);
+
+	pthread_cond_destroy(&srv.not_full);
+	pthread_cond_destroy(&srv.not_empty);
+	pthread_mutex_destroy(&srv.lock);
+
+	return 0;
+}
+
+/* Client side of serve(): sends stdin to the server at 'path' and copies
+ * the reply to stdout. Returns 0 if an image was received, 1 otherwise.
+ */
+int serve_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	char buff[64 * 1024];
+	size_t total = 0;
+	ssize_t n, w, off;
+	int fd;
+
+	if (unix_address(path, &addr) != 0)
+		return 1;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+			|| connect(fd, (struct sockaddr *)&addr, sizeof addr) != 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+
+	while ((n = read(STDIN_FILENO, buff, sizeof buff)) > 0) {
+		for (off = 0; off < n; off += w) {
+			if ((w = write(fd, buff + off, n - off)) < 0) {
+				perror(path);
+				close(fd);
+				return 1;
+			}
+		}
+	}
+	shutdown(fd, SHUT_WR);
+
+	while ((n = read(fd, buff, sizeof buff)) > 0) {
+		if (fwrite(buff, 1, n, stdout) != (size_t)n)
+			break;
+		total += n;
+	}
+	close(fd);
+
+	if (total == 0) {
+		fprintf(stderr, "%s: the server could not render the input\n",
+				path);
+		return 1;
+	}
+	return fflush(stdout) != 0;
+}
+
+
+/***************************************************************************
+ * Thread pool
+ ***************************************************************************/
+
+static int pool_init(struct thread_pool *pool, int n_threads)
+{
+	int i;
+
+	if ((pool->threads = malloc(n_threads * sizeof *pool->threads)) == NULL)
+		return -1;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cv, NULL);
+	pthread_cond_init(&pool->done_cv, NULL);
+	pool->generation = 0;
+	pool->busy = 0;
+	pool->quit = 0;
+
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0)
+			break;
+	}
+	pool->n_threads = i;
+
+	return 0;
+}
+
+static void pool_run(struct thread_pool *pool, void (*fn)(void *arg), void *arg)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->busy = pool->n_threads;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_cv);
+	pthread_mutex_unlock(&pool->lock);
+
+	fn(arg);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy)
+		pthread_cond_wait(&pool->done_cv, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_destroy(struct thread_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work_cv);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->n_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cv);
+	pthread_cond_destroy(&pool->work_cv);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+}
+
+static void *pool_worker(void *arg)
+{
+	struct thread_pool *pool = arg;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->quit && pool->generation == seen)
+			pthread_cond_wait(&pool->work_cv, &pool->lock);
+		if (pool->quit)
+			break;
+		seen = pool->generation;
+
+		pthread_mutex_unlock(&pool->lock);
+		pool->fn(pool->arg);
+		pthread_mutex_lock(&pool->lock);
+
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done_cv);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+
+/***************************************************************************
+ * Compiled display lists
+ ***************************************************************************/
+
+static uint32_t get_u32le(const unsigned char *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8
+		| (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static unsigned char *put_u32le(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+	return p + 4;
+}
+
+static int dlist_is_compiled(const struct script_buf *sb)
+{
+	return sb->len >= DLIST_HEADER_SZ
+		&& memcmp(sb->data, DLIST_MAGIC, 4) == 0;
+}
+
+/* Decodes a display list written by dlist_write(). The records are copied
+ * into 'cmds' as-is; no text is involved.
+ */
+static int dlist_read(const struct script_buf *sb, struct bitmap *bmap,
+		struct cmd_list *cmds)
+{
+	const unsigned char *p = (const unsigned char *)sb->data;
+	const unsigned char *end = p + sb->len;
+	uint32_t version, n, n_verts = 0, i;
+	int a;
+
+	version = get_u32le(p + 4);
+	bmap->w = (int32_t)get_u32le(p + 8);
+	bmap->h = (int32_t)get_u32le(p + 12);
+	n = get_u32le(p + 16);
+
+	if (version != 1 && version != DLIST_VERSION) {
+		script_error(sb, "Display list version %lu not supported\n",
+				(unsigned long)version);
+		return 1;
+	}
+	if (bmap->w < 0 || bmap->h < 0
+			|| (sb->len - DLIST_HEADER_SZ) / DLIST_RECORD_SZ < n) {
+		script_error(sb, "Display list truncated or corrupt\n");
+		return 1;
+	}
+
+	if (n && (cmds->cmds = malloc(n * sizeof *cmds->cmds)) == NULL) {
+		fputs("ERROR: Could not allocate memory for commands\n", stderr);
+		return 1;
+	}
+	cmds->max_elems = n;
+
+	p += DLIST_HEADER_SZ;
+	for (i = 0; i < n; i++, p += DLIST_RECORD_SZ) {
+		struct cmd *cmd = &cmds->cmds[i];
+		uint32_t id = get_u32le(p);
+
+		if (id >= CMD_COUNT) {
+			script_error(sb, "Display list record %lu: bad command %lu\n",
+					(unsigned long)i, (unsigned long)id);
+			return 1;
+		}
+		cmd->id = id;
+		cmd->colour = get_u32le(p + 4);
+		for (a = 0; a < 4; a++)
+			cmd->args[a] = (int32_t)get_u32le(p + 8 + 4 * a);
+		cmds->n++;
+	}
+
+	if (version >= 2) {
+		if (end - p < 4 || (size_t)(end - p - 4) / 4 < (n_verts
+				= get_u32le(p))) {
+			script_error(sb, "Display list truncated or corrupt\n");
+			return 1;
+		}
+		p += 4;
+		if (n_verts && (cmds->verts = malloc((size_t)n_verts
+				* sizeof *cmds->verts)) == NULL) {
+			fputs("ERROR: Could not allocate memory for vertices\n",
+					stderr);
+			return 1;
+		}
+		cmds->n_verts = cmds->max_verts = n_verts;
+		for (i = 0; i < n_verts; i++, p += 4)
+			cmds->verts[i] = (int32_t)get_u32le(p);
+	}
+
+	for (i = 0; i < n; i++) {
+		const struct cmd *cmd = &cmds->cmds[i];
+
+		if ((cmd->id == CMD_POLYLINE || cmd->id == CMD_POLYGON)
+				&& (cmd->args[0] < 0 || cmd->args[1] < 1
+					|| cmd->args[0] + 2 * (long long)cmd->args[1]
+					> n_verts)) {
+			script_error(sb, "Display list record %lu: bad vertices\n",
+					(unsigned long)i);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int dlist_write(FILE *fpo, const struct bitmap *bmap,
+		const struct cmd_list *cmds)
+{
+	unsigned char buff[DLIST_RECORD_SZ * 1024];
+	unsigned char *p;
+	size_t i, len;
+	int a;
+
+	p = buff;
+	memcpy(p, DLIST_MAGIC, 4);
+	p = put_u32le(p + 4, DLIST_VERSION);
+	p = put_u32le(p, bmap->w);
+	p = put_u32le(p, bmap->h);
+	p = put_u32le(p, cmds->n);
+	if (fwrite(buff, 1, p - buff, fpo) != (size_t)(p - buff))
+		goto write_error;
+
+	for (i = 0; i < cmds->n; ) {
+		p = buff;
+		for ( ; i < cmds->n && p < buff + sizeof buff; i++) {
+			const struct cmd *cmd = &cmds->cmds[i];
+			p = put_u32le(p, cmd->id);
+			p = put_u32le(p, cmd->colour);
+			for (a = 0; a < 4; a++)
+				p = put_u32le(p, cmd->args[a]);
+		}
+		len = p - buff;
+		if (fwrite(buff, 1, len, fpo) != len)
+			goto write_error;
+	}
+
+	p = put_u32le(buff, cmds->n_verts);
+	for (i = 0; i < cmds->n_verts; ) {
+		for ( ; i < cmds->n_verts && p < buff + sizeof buff; i++)
+			p = put_u32le(p, cmds->verts[i]);
+		len = p - buff;
+		if (fwrite(buff, 1, len, fpo) != len)
+			goto write_error;
+		p = buff;
+	}
+	if (p != buff && fwrite(buff, 1, p - buff, fpo) != (size_t)(p - buff))
+		goto write_error;
+
+	return 0;
+
+write_error:
+	fputs("ERROR: Writing display list failed\n", stderr);
+	return 1;
+}
+
+
+/***************************************************************************
+ * Render cache
+ ***************************************************************************/
+
+/* Sets hashes[k] to the 64-bit FNV-1a hash of the dimensions of 'bmap' and
+ * the first k commands, for k = 0..cmds->n. Commands are hashed in their
+ * display list encoding, so whitespace and comments in the script don't
+ * matter; the vertices of polylines and polygons follow their record.
+ */
+static void cache_hashes(const struct bitmap *bmap, const struct cmd_list *cmds,
+		uint64_t *hashes)
+{
+	unsigned char rec[DLIST_RECORD_SZ], *p;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i, j;
+	int a;
+
+	p = put_u32le(rec, CACHE_VERSION);
+	p = put_u32le(p, bmap->w);
+	p = put_u32le(p, bmap->h);
+	for (j = 0; j < (size_t)(p - rec); j++)
+		h = (h ^ rec[j]) * 0x100000001b3ULL;
+	hashes[0] = h;
+
+	for (i = 0; i < cmds->n; i++) {
+		const struct cmd *cmd = &cmds->cmds[i];
+
+		p = put_u32le(rec, cmd->id);
+		p = put_u32le(p, cmd->colour);
+		for (a = 0; a < 4; a++)
+			p = put_u32le(p, cmd->args[a]);
+		for (j = 0; j < DLIST_RECORD_SZ; j++)
+			h = (h ^ rec[j]) * 0x100000001b3ULL;
+		if (cmd->id == CMD_POLYLINE || cmd->id == CMD_POLYGON) {
+			for (a = 0; a < 2 * cmd->args[1]; a++) {
+				p = put_u32le(rec, cmds->verts[cmd->args[0] + a]);
+				for (j = 0; j < 4; j++)
+					h = (h ^ rec[j]) * 0x100000001b3ULL;
+			}
+		}
+		hashes[i + 1] = h;
+	}
+}
+
+/* Loads the checkpoint in 'dir' covering the longest prefix of the n
+ * commands hashed in 'hashes' into the canvas of 'bmap'.
+ *
+ * Returns the number of commands the canvas now reflects; 0 if no usable
+ * checkpoint was found (the canvas is left cleared, as it was).
+ */
+static size_t cache_restore(const char *dir, const struct bitmap *bmap,
+		const uint64_t *hashes, size_t n)
+{
+	unsigned char hdr[CACHE_HEADER_SZ];
+	uint64_t *have = NULL, *tmp, v;
+	size_t n_have = 0, max_have = 0, k, len, npx;
+	struct dirent *de;
+	struct stat st;
+	char *path, *end;
+	DIR *d;
+	FILE *fp;
+
+	if ((d = opendir(dir)) == NULL)
+		return 0;
+	while ((de = readdir(d)) != NULL) {
+		len = strlen(de->d_name);
+		if (len != 16 + strlen(CACHE_SUFFIX)
+				|| strcmp(de->d_name + 16, CACHE_SUFFIX) != 0)
+			continue;
+		v = strtoull(de->d_name, &end, 16);
+		if (end != de->d_name + 16)
+			continue;
+		if (n_have == max_have) {
+			max_have = max_have ? max_have * 2 : 64;
+			if ((tmp = realloc(have, max_have * sizeof *have)) == NULL)
+				break;
+			have = tmp;
+		}
+		have[n_have++] = v;
+	}
+	closedir(d);
+	if (n_have)
+		qsort(have, n_have, sizeof *have, u64_cmp);
+
+	npx = (size_t)bmap->w * bmap->h;
+	for (k = n; k > 0; k--) {
+		if (!n_have || !bsearch(&hashes[k], have, n_have, sizeof *have,
+				u64_cmp))
+			continue;
+		if ((path = cache_path(dir, hashes[k], CACHE_SUFFIX)) == NULL)
+			break;
+		fp = fopen(path, "rb");
+		free(path);
+		if (fp == NULL)
+			continue;
+		/* a file of the wrong size is truncated or corrupt; skip it
+		 * before any pixels reach the canvas
+		 */
+		if (fstat(fileno(fp), &st) != 0
+				|| (uint64_t)st.st_size != CACHE_HEADER_SZ
+					+ (uint64_t)npx * sizeof *bmap->data) {
+			fclose(fp);
+			continue;
+		}
+		if (fread(hdr, 1, sizeof hdr, fp) == sizeof hdr
+				&& memcmp(hdr, CACHE_MAGIC, 4) == 0
+				&& get_u32le(hdr + 4) == CACHE_VERSION
+				&& (int32_t)get_u32le(hdr + 8) == bmap->w
+				&& (int32_t)get_u32le(hdr + 12) == bmap->h
+				&& (get_u32le(hdr + 16)
+					| (uint64_t)get_u32le(hdr + 20) << 32) == k
+				&& (get_u32le(hdr + 24)
+					| (uint64_t)get_u32le(hdr + 28) << 32) == hashes[k]) {
+			if (fread(bmap->data, sizeof *bmap->data, npx, fp) == npx) {
+				fclose(fp);
+				free(have);
+				return k;
+			}
+			/* shrank or failed while being read: undo the part that
+			 * was copied
+			 */
+			memset(bmap->data, 0, npx * sizeof *bmap->data);
+		}
+		fclose(fp);
+	}
+
+	free(have);
+	return 0;
+}
+
+/* Writes the canvas of 'bmap', the result of n commands with prefix hash
+ * 'hash', to 'dir'. The file is written under a temporary name and renamed
+ * into place so concurrent renders never see a partial checkpoint. Failure
+ * only costs the checkpoint and is reported as a warning.
+ */
+static void cache_save(const char *dir, const struct bitmap *bmap, size_t n,
+		uint64_t hash)
+{
+	unsigned char hdr[CACHE_HEADER_SZ], *p;
+	static unsigned int seq;
+	char suffix[48], *tmp_path, *path;
+	size_t npx = (size_t)bmap->w * bmap->h;
+	FILE *fp;
+	int ok;
+
+	snprintf(suffix, sizeof suffix, ".tmp%ld.%u", (long)getpid(),
+			__sync_fetch_and_add(&seq, 1));
+	tmp_path = cache_path(dir, hash, suffix);
+	path = cache_path(dir, hash, CACHE_SUFFIX);
+	if (!tmp_path || !path || (fp = fopen(tmp_path, "wb")) == NULL) {
+		fprintf(stderr, "WARNING: Could not write a checkpoint to %s\n",
+				dir);
+		free(tmp_path);
+		free(path);
+		return;
+	}
+
+	p = hdr;
+	memcpy(p, CACHE_MAGIC, 4);
+	p = put_u32le(p + 4, CACHE_VERSION);
+	p = put_u32le(p, bmap->w);
+	p = put_u32le(p, bmap->h);
+	p = put_u32le(p, (uint64_t)n);
+	p = put_u32le(p, (uint64_t)n >> 32);
+	p = put_u32le(p, hash);
+	p = put_u32le(p, hash >> 32);
+
+	ok = fwrite(hdr, 1, sizeof hdr, fp) == sizeof hdr
+		&& fwrite(bmap->data, sizeof *bmap->data, npx, fp) == npx;
+	ok &= fclose(fp) == 0;
+	if (!ok || rename(tmp_path, path) != 0) {
+		fprintf(stderr, "WARNING: Could not write checkpoint %s\n", path);
+		remove(tmp_path);
+	}
+
+	free(tmp_path);
+	free(path);
+}
+
+
+/***************************************************************************
+ * Script input
+ ***************************************************************************/
+
+/* Makes the whole of 'fp' available in memory. Regular files are mapped
+ * (the mapping is private and read-only), anything else (pipes, terminals)
+ * is read into a growing buffer. Returns 0 on success, non-zero on error.
+ */
+static int script_load(FILE *fp, struct script_buf *sb)
+{
+	struct stat st;
+	char *buff = NULL;
+	size_t len = 0, max_len = 0, n;
+	int fd = fileno(fp);
+
+	sb->map_len = 0;
+	sb->name = NULL;
+
+	if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+			&& st.st_size > 0 && lseek(fd, 0, SEEK_CUR) == 0) {
+		void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m != MAP_FAILED) {
+			madvise(m, st.st_size, MADV_SEQUENTIAL);
+			sb->data = m;
+			sb->len = sb->map_len = st.st_size;
+			return 0;
+		}
+	}
+
+	do {
+		if (len == max_len) {
+			char *tmp;
+			max_len = max_len ? max_len * 2 : 65536;
+			if ((tmp = realloc(buff, max_len)) == NULL) {
+				fputs("ERROR: Could not allocate memory for input\n",
+						stderr);
+				free(buff);
+				return 1;
+			}
+			buff = tmp;
+		}
+		n = fread(buff + len, 1, max_len - len, fp);
+		len += n;
+	} while (n > 0);
+
+	if (ferror(fp)) {
+		fprintf(stderr, "ERROR: Reading input failed: %s\n",
+				strerror(errno));
+		free(buff);
+		return 1;
+	}
+
+	sb->data = buff;
+	sb->len = len;
+
+	return 0;
+}
+
+static void script_release(struct script_buf *sb)
+{
+	if (sb->map_len)
+		munmap((void *)sb->data, sb->map_len);
+	else
+		free((void *)sb->data);
+	sb->data = NULL;
+}
+
+/* Reads an optionally signed decimal integer, skipping leading blanks, in
+ * the manner of sscanf("%d"). Returns 1 on success, 0 if no number follows.
+ */
+static int lex_int(struct lexer *lx, int *v)
+{
+	const char *p = lx->p;
+	unsigned int n = 0;
+	int neg = 0;
+
+	while (p < lx->eol && (*p == ' ' || *p == '\t' || *p == '\r'
+			|| *p == '\v' || *p == '\f'))
+		p++;
+
+	if (p < lx->eol && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+
+	if (p == lx->eol || (unsigned)(*p - '0') > 9)
+		return 0;
+
+	do {
+		n = n * 10 + (unsigned)(*p++ - '0');
+	} while (p < lx->eol && (unsigned)(*p - '0') <= 9);
+
+	*v = neg ? (int)(0u - n) : (int)n;
+	lx->p = p;
+
+	return 1;
+}
+
+/* Returns the length of the whitespace delimited word at the cursor (leading
+ * whitespace has already been skipped) and advances past it.
+ */
+static size_t lex_word(struct lexer *lx, const char **word)
+{
+	const char *p = lx->p;
+
+	while (p < lx->eol && !isspace((unsigned char)*p))
+		p++;
+
+	*word = lx->p;
+	lx->p = p;
+
+	return p - *word;
+}
+
+/* Advances the cursor past any whitespace */
+static void lex_space(struct lexer *lx)
+{
+	while (lx->p < lx->eol && isspace((unsigned char)*lx->p))
+		lx->p++;
+}
+
+
+/***************************************************************************
+ * Command list
+ ***************************************************************************/
+
+static int cmd_list_push(struct cmd_list *list, const struct cmd *cmd)
+{
+	if (list->n == list->max_elems) {
+		size_t sz = list->max_elems ? list->max_elems * 2 : 1024;
+		struct cmd *tmp;
+
+		if ((tmp = realloc(list->cmds, sz * sizeof *tmp)) == NULL)
+			return 1;
+		list->cmds = tmp;
+		list->max_elems = sz;
+	}
+
+	list->cmds[list->n++] = *cmd;
+
+	return 0;
+}
+
+/* Appends 'v' to the vertex pool of 'list'; the pool is indexed with ints,
+ * so it is limited to INT_MAX entries.
+ */
+static int cmd_list_push_vert(struct cmd_list *list, int v)
+{
+	if (list->n_verts == list->max_verts) {
+		size_t sz = list->max_verts ? list->max_verts * 2 : 1024;
+		int *tmp;
+
+		if (list->max_verts >= INT_MAX)
+			return 1;
+		if (sz > INT_MAX)
+			sz = INT_MAX;
+		if ((tmp = realloc(list->verts, sz * sizeof *tmp)) == NULL)
+			return 1;
+		list->verts = tmp;
+		list->max_verts = sz;
+	}
+
+	list->verts[list->n_verts++] = v;
+
+	return 0;
+}
+
+static void cmd_list_free(struct cmd_list *list)
+{
+	free(list->cmds);
+	list->cmds = NULL;
+	list->n = list->max_elems = 0;
+	free(list->verts);
+	list->verts = NULL;
+	list->n_verts = list->max_verts = 0;
+}
+
+
+/***************************************************************************
+ * "Bitmap"
+ ***************************************************************************/
+
+uint32_t fromRGB(const struct rgb255 *c)
+{
+	return
+		((uint32_t)(c->r & 0xff)) << 16 |
+		((uint32_t)(c->g & 0xff)) << 8 |
+		((uint32_t)(c->b & 0xff));
+}
+
+/* Like fromRGB(), with the transparency (255 - alpha) in the top byte so
+ * that opaque colours look exactly like fromRGB() ones.
+ */
+uint32_t fromRGBA(const struct rgb255 *c, int alpha)
+{
+	return fromRGB(c) | (uint32_t)(255 - (alpha & 0xff)) << 24;
+}
+
+void toRGB(uint32_t c, struct rgb255 *dest)
+{
+	dest->r = (c >> 16) & 0xff;
+	dest->g = (c >> 8) & 0xff;
+	dest->b = c & 0xff;
+}
+
+/* Allocates a zeroed bmap->w x bmap->h canvas. If 'path' is not NULL the
+ * canvas is a shared mapping of that file (which must not exist yet, and
+ * is unlinked once mapped), so canvases larger than RAM are paged to disk
+ * rather than to swap. An existing file or symlink is never touched. If
+ * 'unique' is set, as for jobs that may run concurrently, the file is
+ * instead a new one named 'path' plus a random suffix.
+ *
+ * Returns 0 on success, non-zero (after printing a message) on failure.
+ */
+static int bitmap_alloc(struct bitmap *bmap, const char *path, int unique)
+{
+	size_t n = (size_t)bmap->w * bmap->h;
+	char *tmpl = NULL;
+	void *m;
+	int fd;
+
+	bmap->data = NULL;
+	bmap->map_len = 0;
+	bmap->y_origin = 0;
+
+	if (bmap->h != 0 && (size_t)bmap->w > SIZE_MAX / sizeof *bmap->data
+			/ bmap->h) {
+		fprintf(stderr, "Canvas %dx%d is too large\n", bmap->w, bmap->h);
+		return 1;
+	}
+
+	if (path == NULL || n == 0) {
+		if ((bmap->data = calloc(n, sizeof *bmap->data)) == NULL) {
+			fprintf(stderr, "ERROR: Could not allocate %dx%d canvas"
+					" (see --mmap)\n", bmap->w, bmap->h);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (unique) {
+		size_t len = strlen(path) + 8;
+
+		if ((tmpl = malloc(len)) == NULL) {
+			fputs("ERROR: Could not allocate memory for the canvas\n",
+					stderr);
+			return 1;
+		}
+		snprintf(tmpl, len, "%s.XXXXXX", path);
+		if ((fd = mkstemp(tmpl)) < 0) {
+			perror(tmpl);
+			free(tmpl);
+			return 1;
+		}
+		unlink(tmpl);
+		free(tmpl);
+	} else if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW,
+				0600)) < 0) {
+		if (errno == EEXIST)
+			fprintf(stderr, "ERROR: %s already exists, not using it for"
+					" the canvas\n", path);
+		else
+			perror(path);
+		return 1;
+	} else {
+		unlink(path);
+	}
+
+	if (ftruncate(fd, (off_t)(n * sizeof *bmap->data)) != 0) {
+		perror(path);
+		close(fd);
+		return 1;
+	}
+	m = mmap(NULL, n * sizeof *bmap->data, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		perror(path);
+		return 1;
+	}
+
+	bmap->data = m;
+	bmap->map_len = n * sizeof *bmap->data;
+	return 0;
+}
+
+/* Like bitmap_alloc() without a file, but uses the buffer in 'canvas',
+ * which is reallocated only if it is too small or much larger than
+ * needed. The canvas stays owned by 'canvas'.
+ */
+static int canvas_get(struct canvas_buf *canvas, struct bitmap *bmap)
+{
+	size_t n = (size_t)bmap->w * bmap->h;
+
+	bmap->data = NULL;
+	bmap->map_len = 0;
+	bmap->y_origin = 0;
+
+	if (bmap->h != 0 && (size_t)bmap->w > SIZE_MAX / sizeof *bmap->data
+			/ bmap->h) {
+		fprintf(stderr, "Canvas %dx%d is too large\n", bmap->w, bmap->h);
+		return 1;
+	}
+
+	if (canvas->data && (n > canvas->cap || n < canvas->cap / 4)) {
+		free(canvas->data);
+		canvas->data = NULL;
+		canvas->cap = 0;
+	}
+	if (canvas->data == NULL) {
+		if ((canvas->data = malloc((n + 1) * sizeof *canvas->data)) == NULL) {
+			fprintf(stderr, "ERROR: Could not allocate %dx%d canvas\n",
+					bmap->w, bmap->h);
+			return 1;
+		}
+		canvas->cap = n;
+	}
+
+	memset(canvas->data, 0, n * sizeof *canvas->data);
+	bmap->data = canvas->data;
+	return 0;
+}
+
+/* Returns a new w x h canvas, cleared to black, or NULL on error */
+struct bitmap *bitmap_new(int w, int h)
+{
+	struct bitmap *bmap;
+
+	if (w < 0 || h < 0)
+		return NULL;
+	if ((bmap = malloc(sizeof *bmap)) == NULL) {
+		fputs("ERROR: Could not allocate memory for the canvas\n", stderr);
+		return NULL;
+	}
+
+	bmap->w = w;
+	bmap->h = h;
+	bmap->stats = NULL;
+	if (bitmap_alloc(bmap, NULL, 0) != 0) {
+		free(bmap);
+		return NULL;
+	}
+	bmap->clip.x1 = bmap->clip.y1 = 0;
+	bmap->clip.x2 = w;
+	bmap->clip.y2 = h;
+
+	return bmap;
+}
+
+/* Frees a canvas from bitmap_new() or script_render() */
+void bitmap_destroy(struct bitmap *bmap)
+{
+	bitmap_free(bmap);
+	free(bmap);
+}
+
+static void bitmap_free(struct bitmap *bmap)
+{
+	if (bmap->map_len)
+		munmap(bmap->data, bmap->map_len);
+	else
+		free(bmap->data);
+	bmap->data = NULL;
+	bmap->map_len = 0;
+}
+
+void bitmap_setpixel(const struct bitmap *bmap, uint32_t c,
+		int x, int y)
+{
+	bmap->data[x + (size_t)(y - bmap->y_origin) * bmap->w] = c;
+}
+
+uint32_t bitmap_getpixel(const struct bitmap *bmap, int x, int y)
+{
+	return bmap->data[x + (size_t)(y - bmap->y_origin) * bmap->w];
+}
+
+
+/***************************************************************************
+ * Drawing
+ ***************************************************************************/
+
+void draw_point(const struct bitmap *bmap, uint32_t c,
+				const struct point2d *p)
+{
+	draw_point_xy(bmap, c, p->x, p->y);
+}
+
+void draw_point_xy(const struct bitmap *bmap, uint32_t c,
+		int x, int y)
+{
+	if (x < bmap->clip.x1 || x >= bmap->clip.x2
+			|| y < bmap->clip.y1 || y >= bmap->clip.y2) {
+		STAT_PIXELS(bmap, 0, 1);
+		return;
+	}
+
+	if (c >> 24)
+		blend_u32(bmap->data + x + (size_t)(y - bmap->y_origin) * bmap->w,
+				c, 1);
+	else
+		bitmap_setpixel(bmap, c, x, y);
+	STAT_PIXELS(bmap, 1, 1);
+}
+
+void draw_line(const struct bitmap *bmap, uint32_t c,
+			   const struct point2d *p1, const struct point2d *p2)
+{
+	draw_segment(bmap, c, p1, p2, 0);
+}
+
+/* Draws the line p1..p2 like draw_line, leaving out p1 and/or p2 as asked
+ * by 'skip' (SEG_SKIP_START, SEG_SKIP_END) so that joined segments plot
+ * their shared vertices once. The pixels that are drawn are exactly those
+ * of the full line.
+ */
+static void draw_segment(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *p1, const struct point2d *p2, int skip)
+{
+	if (p1->x == p2->x || p1->y == p2->y) {
+		struct point2d a = *p1, b = *p2;
+		int xstep = b.x > a.x ? 1 : (b.x < a.x ? -1 : 0);
+		int ystep = b.y > a.y ? 1 : (b.y < a.y ? -1 : 0);
+
+		/* Axis-aligned: the ends can simply be stepped inwards */
+		if (skip & SEG_SKIP_START) {
+			if (a.x == b.x && a.y == b.y)
+				return;
+			a.x += xstep;
+			a.y += ystep;
+		}
+		if (skip & SEG_SKIP_END) {
+			if (a.x == b.x && a.y == b.y)
+				return;
+			b.x -= xstep;
+			b.y -= ystep;
+		}
+		if (a.x == b.x)
+			draw_vline(bmap, c, &a, &b);
+		else
+			draw_hline(bmap, c, &a, &b);
+	} else {
+		/* Use Bresenham's LDA, clipped to the canvas and drawn in run-slice
+		 * form.
+		 *
+		 * Working along the "x"-axis (the major axis after mirroring),
+		 * step k = 0..dx plots (a.x + k, a.y + ystep * m(k)) where
+		 *
+		 *     m(k) = ceil((2*dy*k - dx) / (2*dx))
+		 *
+		 * is the number of minor-axis steps taken before step k; this is
+		 * exactly what the classic error-accumulator loop produces. Because
+		 * m(k) is known in closed form the loop can start and stop at the
+		 * clip edges, and the last step of each run (all k with the same
+		 * m) is found directly instead of pixel by pixel. The arithmetic is
+		 * exact while the line spans less than 2^31 on each axis.
+		 */
+		struct point2d a, b;
+		int steep, ystep, maj_min, maj_max, min_min, min_max;
+		int skip_a, skip_b;
+		long long dx, dy, k, k_end, m, m_lo, m_hi, q, r, q_step, r_step;
+		long long drawn = 0;
+		ptrdiff_t stride;
+		uint32_t *dest;
+
+		/* steep... 0 shallow-slope, 1 steep */
+		steep = abs(p2->y - p1->y) > abs(p2->x - p1->x) ? 1 : 0;
+		a.x = steep ? p1->y : p1->x;
+		a.y = steep ? p1->x : p1->y;
+		b.x = steep ? p2->y : p2->x;
+		b.y = steep ? p2->x : p2->y;
+		/* clip range (inclusive) of the major and minor axes */
+		maj_min = steep ? bmap->clip.y1 : bmap->clip.x1;
+		maj_max = (steep ? bmap->clip.y2 : bmap->clip.x2) - 1;
+		min_min = steep ? bmap->clip.x1 : bmap->clip.y1;
+		min_max = (steep ? bmap->clip.x2 : bmap->clip.y2) - 1;
+
+		skip_a = skip & SEG_SKIP_START;
+		skip_b = skip & SEG_SKIP_END;
+		if (a.x > b.x) {	/* Work along the "x"-axis */
+			SWAP(struct point2d, a, b);
+			SWAP(int, skip_a, skip_b);
+		}
+
+		dx = (long long)b.x - a.x;
+		dy = llabs((long long)b.y - a.y);
+		ystep = b.y < a.y ? -1 : 1;
+
+		/* Clip the major axis; a skipped end is one step less */
+		k = a.x < maj_min ? (long long)maj_min - a.x : 0;
+		if (skip_a && k < 1)
+			k = 1;
+		k_end = (long long)maj_max - a.x;
+		if (k_end > dx - (skip_b != 0))
+			k_end = dx - (skip_b != 0);
+
+		/* Clip the minor axis: m(k) must stay within [m_lo, m_hi] */
+		if (ystep > 0) {
+			m_lo = (long long)min_min - a.y;
+			m_hi = (long long)min_max - a.y;
+		} else {
+			m_lo = (long long)a.y - min_max;
+			m_hi = (long long)a.y - min_min;
+		}
+		if (m_hi < 0 || m_lo > dy)
+			goto done;
+		if (m_lo > 0 && k < (2 * dx * m_lo - dx) / (2 * dy) + 1)
+			k = (2 * dx * m_lo - dx) / (2 * dy) + 1;
+		if (k_end > (2 * dx * m_hi + dx) / (2 * dy))
+			k_end = (2 * dx * m_hi + dx) / (2 * dy);
+
+		/* Runs: run m ends at the last k with m(k) == m, which is
+		 * floor((2*dx*m + dx) / (2*dy)); track it as quotient q and
+		 * remainder r and advance both by 2*dx / (2*dy) per run.
+		 */
+		m = (2 * dy * k + dx - 1) / (2 * dx);
+		q = (2 * dx * m + dx) / (2 * dy);
+		r = (2 * dx * m + dx) % (2 * dy);
+		q_step = dx / dy;
+		r_step = (2 * dx) % (2 * dy);
+
+		while (k <= k_end) {
+			long long end = q < k_end ? q : k_end;
+			long long minor = a.y + ystep * m;
+			size_t n = end - k + 1;
+
+			drawn += n;
+			if (steep) {	/* vertical run at column 'minor' */
+				stride = bmap->w;
+				dest = bmap->data + minor
+					+ (size_t)(a.x + k - bmap->y_origin) * bmap->w;
+				put_u32_strided(dest, stride, c, n);
+			} else {
+				dest = bmap->data + (a.x + k)
+					+ (size_t)(minor - bmap->y_origin) * bmap->w;
+				put_u32(dest, c, n);
+			}
+
+			k = end + 1;
+			m++;
+			q += q_step;
+			r += r_step;
+			if (r >= 2 * dy) {
+				q++;
+				r -= 2 * dy;
+			}
+		}
+done:
+		STAT_PIXELS(bmap, drawn, dx + 1 - (skip_a != 0) - (skip_b != 0));
+	}
+}
+
+static void draw_vline(const struct bitmap *bmap, uint32_t c,
+				const struct point2d *p1, const struct point2d *p2)
+{
+	int y1, y2;
+	long long n;
+	uint32_t *dest;
+
+	y1 = p1->y;
+	y2 = p2->y;
+	if (y1 > y2)
+		SWAP(int, y1, y2);
+	n = (long long)y2 - y1 + 1;
+
+	if (p1->x < bmap->clip.x1 || p1->x >= bmap->clip.x2) {
+		STAT_PIXELS(bmap, 0, n);
+		return;
+	}
+
+	if (y1 < bmap->clip.y1)
+		y1 = bmap->clip.y1;
+	if (y2 >= bmap->clip.y2)
+		y2 = bmap->clip.y2 - 1;
+	STAT_PIXELS(bmap, y1 <= y2 ? y2 - y1 + 1 : 0, n);
+
+	if (y1 <= y2) {
+		dest = bmap->data + p1->x + (size_t)(y1 - bmap->y_origin) * bmap->w;
+		put_u32_strided(dest, bmap->w, c, y2 - y1 + 1);
+	}
+}
+
+static void draw_hline(const struct bitmap *bmap, uint32_t c,
+				const struct point2d *p1, const struct point2d *p2)
+{
+	draw_span(bmap, c, p1->x, p2->x, p1->y);
+}
+
+/* Spans are the core of all horizontal filling: the run x1..x2 (inclusive,
+ * in either order) on row 'y' is clipped once and then stored as a
+ * contiguous block of pixels.
+ */
+void draw_span(const struct bitmap *bmap, uint32_t c, int x1, int x2, int y)
+{
+	long long n;
+
+	if (x1 > x2)
+		SWAP(int, x1, x2);
+	n = (long long)x2 - x1 + 1;
+
+	if (y < bmap->clip.y1 || y >= bmap->clip.y2) {
+		STAT_PIXELS(bmap, 0, n);
+		return;
+	}
+
+	if (x1 < bmap->clip.x1)
+		x1 = bmap->clip.x1;
+	if (x2 >= bmap->clip.x2)
+		x2 = bmap->clip.x2 - 1;
+	if (x1 > x2) {
+		STAT_PIXELS(bmap, 0, n);
+		return;
+	}
+	STAT_PIXELS(bmap, x2 - x1 + 1, n);
+
+	put_u32(bmap->data + x1 + (size_t)(y - bmap->y_origin) * bmap->w, c,
+			x2 - x1 + 1);
+}
+
+void draw_rect(const struct bitmap *bmap, uint32_t c,
+			   const struct point2d *p1, const struct point2d *p2)
+{
+	int x1, x2, y1, y2;
+	long long n;
+	uint32_t *row;
+
+	/* Rows p1->y up to (not including) p2->y, columns p1->x to p2->x
+	 * inclusive
+	 */
+	x1 = p1->x;
+	x2 = p2->x;
+	y1 = p1->y;
+	y2 = p2->y;
+	if (x1 > x2)
+		SWAP(int, x1, x2);
+	if (y1 > y2)
+		SWAP(int, y1, y2);
+	n = ((long long)x2 - x1 + 1) * ((long long)y2 - y1);
+
+	if (x1 < bmap->clip.x1)
+		x1 = bmap->clip.x1;
+	if (x2 >= bmap->clip.x2)
+		x2 = bmap->clip.x2 - 1;
+	if (y1 < bmap->clip.y1)
+		y1 = bmap->clip.y1;
+	if (y2 > bmap->clip.y2)
+		y2 = bmap->clip.y2;
+	if (x1 > x2 || y1 >= y2) {
+		STAT_PIXELS(bmap, 0, n);
+		return;
+	}
+	STAT_PIXELS(bmap, ((long long)x2 - x1 + 1) * (y2 - y1), n);
+
+	row = bmap->data + x1 + (size_t)(y1 - bmap->y_origin) * bmap->w;
+	for ( ; y1 < y2; y1++, row += bmap->w)
+		put_u32(row, c, x2 - x1 + 1);
+}
+
+/* Midpoint circle. Each step of the usual incremental loop plots the point
+ * (x, y) of the first octant and its 7 mirror images, with y the largest
+ * value for which y * (y - 1) < r^2 - x^2. That closed form lets every
+ * octant be drawn on its own, starting and stopping at the edges of the
+ * clip rectangle, so the cost is proportional to the visible pixels.
+ */
+void draw_circle(const struct bitmap *bmap, uint32_t c,
+				 const struct point2d *center, int radius)
+{
+	long long r2, xend;
+	int oct;
+
+	/* Every pixel is plotted once, so translucent outlines blend evenly */
+	draw_point_xy(bmap, c, center->x, center->y + radius);
+	if (radius == 0)
+		return;
+	draw_point_xy(bmap, c, center->x, center->y - radius);
+	draw_point_xy(bmap, c, center->x + radius, center->y);
+	draw_point_xy(bmap, c, center->x - radius, center->y);
+	if (radius < 0)
+		return;
+
+	r2 = (long long)radius * radius;
+	xend = circle_xend(r2, radius);
+	for (oct = 0; oct < 8; oct++)
+		circle_arc(bmap, c, center, r2, xend, oct);
+}
+
+void draw_ellipse(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *center,
+		int radius1, int radius2)
+{
+	/* Adapted from Alois Zingl (2012) "A Rasterizing Algorithm for
+	 * Drawing Curves"
+	 */
+	conic_t a2, b2;
+	long x, y, end;
+	long long umin = LLONG_MIN, umax = LLONG_MAX;	/* visible |x| */
+	long long vmin = LLONG_MIN, vmax = LLONG_MAX;	/* visible y */
+
+	if (radius1 > CONIC_RADIUS_MAX || radius2 > CONIC_RADIUS_MAX) {
+		fputs("ERROR: Ellipse radii too large to draw\n", stderr);
+		return;
+	}
+
+	/* The arc runs from (-radius1, 0) to (0, radius2) with |x| falling
+	 * and y rising; a point is drawn in up to 4 quadrants, so find the
+	 * window of |x| and y that is visible in any of them. Steps before
+	 * the window only update the error terms and the loop stops at its
+	 * far side.
+	 */
+	if (radius1 >= 0 && radius2 >= 0) {
+		long long u1, u2, v1, v2;
+		int q;
+
+		umin = vmin = LLONG_MAX;
+		umax = vmax = -1;
+		for (q = 0; q < 4; q++) {
+			if (!clip_range(bmap->clip.x1, bmap->clip.x2, center->x,
+						q & 1 ? -1 : 1, &u1, &u2)
+					|| !clip_range(bmap->clip.y1, bmap->clip.y2, center->y,
+						q & 2 ? -1 : 1, &v1, &v2)
+					|| u1 > radius1 || v1 > radius2)
+				continue;
+			umin = u1 < umin ? u1 : umin;
+			umax = u2 > umax ? u2 : umax;
+			vmin = v1 < vmin ? v1 : vmin;
+			vmax = v2 > vmax ? v2 : vmax;
+		}
+		if (umax < 0)
+			return;
+	}
+
+	/* err is F(x + 1, y + 1) for F(x, y) = b2 x^2 + a2 y^2 - a2 b2 */
+	a2 = (conic_t)radius1 * radius1;
+	b2 = (conic_t)radius2 * radius2;
+	x = -radius1;
+	y = 0;
+	if (vmin >= 1 && vmin <= radius2) {
+		long x0 = ellipse_row_x(a2, b2, radius1, vmin);
+
+		if (x0 <= 0) {
+			x = x0;
+			y = vmin;
+		} else {
+			/* The arc left the centre column above the window, on row
+			 * vmin only if it stepped there from (0, vmin - 1)
+			 */
+			x = 1;
+			y = vmin - 1;
+			if (ellipse_row_x(a2, b2, radius1, vmin - 1) <= 0
+					&& ellipse_steps_down(a2, b2, 0, vmin))
+				y = vmin;
+		}
+	}
+	/* Likewise start at column -umax if the arc enters the window there:
+	 * x never falls along the arc, so bisect for the last row the arc
+	 * enters left of that column. The arc reaches the column on that row
+	 * unless it steps down from the column before it.
+	 */
+	if (x < 0 && -x > umax) {
+		long xt = -(long)umax, lo = y, hi = radius2, mid;
+
+		while (lo < hi) {
+			mid = lo + (hi - lo + 1) / 2;
+			if (ellipse_row_x(a2, b2, radius1, mid) < xt)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		x = xt;
+		y = lo;
+		if (ellipse_steps_down(a2, b2, xt - 1, lo + 1))
+			y++;
+	}
+	/* Walks the arc from (x, y) with error terms of 'type': both loop
+	 * conditions of the first loop stay true once met, and the rows
+	 * before the window were skipped above if the arc reaches it.
+	 */
+#define WALK(type) \
+	do { \
+		type e2, dx = b2 * (2 * (conic_t)x + 1); \
+		type dy = a2 * (2 * (conic_t)y + 1); \
+		type err = b2 * (x + 1) * (x + 1) + a2 * (y + 1) * (y + 1) \
+			- a2 * b2; \
+		const type ddx = 2 * b2, ddy = 2 * a2; \
+\
+		while (x < 0 && (y < vmin || -x > umax)) { \
+			if (y > vmax) \
+				return; \
+			STEP(); \
+		} \
+		do { \
+			if (y > vmax || -x < umin) \
+				return;		/* past the window, and the rest */ \
+			DRAW(); \
+			STEP(); \
+		} while (x <= 0); \
+	} while (0)
+
+	/* Steps one point along the arc */
+#define STEP() \
+	do { \
+		e2 = 2 * err; \
+		if (e2 >= dx) { \
+			x++; \
+			err += dx += ddx; \
+		} \
+		if (e2 <= dy) { \
+			y++; \
+			err += dy += ddy; \
+		} \
+	} while (0)
+
+	/* Plots the point, skipping mirror images that coincide on the axes */
+#define DRAW() \
+	do { \
+		draw_point_xy(bmap, c, center->x - x, center->y + y); \
+		if (x != 0) \
+			draw_point_xy(bmap, c, center->x + x, center->y + y); \
+		if (y != 0) { \
+			if (x != 0) \
+				draw_point_xy(bmap, c, center->x + x, center->y - y); \
+			draw_point_xy(bmap, c, center->x - x, center->y - y); \
+		} \
+	} while (0)
+
+	/* long long is faster where the error terms fit */
+	if (x > 0)
+		;			/* only the centre column is left */
+	else if (radius1 <= ELLIPSE_LL_RADIUS_MAX
+			&& radius2 <= ELLIPSE_LL_RADIUS_MAX)
+		WALK(long long);
+	else
+		WALK(conic_t);
+#undef DRAW
+#undef STEP
+#undef WALK
+
+	/* the rest of the centre column */
+	if (umin > 0)
+		return;
+	end = vmax < radius2 ? (long)vmax : radius2;
+	if (vmin > 0 && y < vmin - 1)
+		y = vmin - 1;
+	while (y++ < end) {
+		draw_point_xy(bmap, c, center->x, center->y + y);
+		draw_point_xy(bmap, c, center->x, center->y - y);
+	}
+}
+
+/* The filled shapes fill every row with a single span out to the
+ * outermost pixel their outline has on that row (a half-width from the
+ * centre column). The result is the outline plus everything it encloses,
+ * i.e. what "circle" followed by "fill" at the centre produces, without a
+ * flood fill. Only the rows that can be inside the clip rectangle are
+ * computed.
+ */
+void draw_fcircle(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *center, int radius)
+{
+	int *hw, d1, d2;
+
+	if (radius < 0 || !mirrored_rows(bmap->clip.y1, bmap->clip.y2,
+				center->y, radius, &d1, &d2))
+		return;
+	if ((hw = fcircle_rows(radius, d1, d2)) == NULL)
+		return;
+	draw_spans_mirrored(bmap, c, center, hw, d1, d2);
+	free(hw);
+}
+
+void draw_fellipse(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *center,
+		int radius1, int radius2)
+{
+	int *hw, d1, d2;
+
+	if (radius1 < 0 || radius2 < 0 || !mirrored_rows(bmap->clip.y1,
+				bmap->clip.y2, center->y, radius2, &d1, &d2))
+		return;
+	if ((hw = fellipse_rows(radius1, radius2, d1, d2)) == NULL)
+		return;
+	draw_spans_mirrored(bmap, c, center, hw, d1, d2);
+	free(hw);
+}
+
+/* Draws lines between consecutive vertices of the 'n' row, col pairs at
+ * 'v', or a point if there is only one. Each vertex is plotted once, also
+ * where the last one closes the polyline on the first, so translucent
+ * polylines blend evenly at their joints.
+ */
+void draw_polyline(const struct bitmap *bmap, uint32_t c, const int *v,
+		int n)
+{
+	struct point2d p1, p2;
+	int i, skip;
+
+	p2.y = v[0];
+	p2.x = v[1];
+	if (n == 1)
+		draw_point(bmap, c, &p2);
+	for (i = 1; i < n; i++) {
+		p1 = p2;
+		p2.y = v[2 * i];
+		p2.x = v[2 * i + 1];
+		skip = i > 1 ? SEG_SKIP_START : 0;
+		if (i > 1 && i == n - 1 && p2.y == v[0] && p2.x == v[1])
+			skip |= SEG_SKIP_END;
+		draw_segment(bmap, c, &p1, &p2, skip);
+	}
+}
+
+/* Fills the polygon with the 'n' row, col vertices at 'v' by the even-odd
+ * rule, scanning the rows of the clip rectangle with an active edge table.
+ * Vertices are pixel centres and a pixel is drawn if its centre is inside;
+ * left and top edges are inclusive, right and bottom edges exclusive, so
+ * polygons that share an edge don't overlap. Crossings are kept as exact
+ * fractions, so the result doesn't depend on where the clip starts.
+ */
+void draw_polygon(const struct bitmap *bmap, uint32_t c, const int *v,
+		int n)
+{
+	struct poly_edge *edges, **active, *e;
+	long long a, x1, x2;
+	size_t n_edges = 0, n_active, next, i, j;
+	int y, y_end;
+
+	if (n < 3)
+		return;
+
+	edges = malloc(n * sizeof *edges);
+	active = malloc(n * sizeof *active);
+	if (!edges || !active) {
+		fputs("ERROR: Could not allocate edges for polygon\n", stderr);
+		free(edges);
+		free(active);
+		return;
+	}
+
+	y_end = INT_MIN;
+	for (i = 0; i < (size_t)n; i++) {
+		const int *p = v + 2 * i, *q = v + 2 * ((i + 1) % n);
+		long long dx;
+
+		if (p[0] == q[0])
+			continue;	/* horizontal edges never cross a row */
+		if (p[0] > q[0]) {
+			const int *t = p;
+			p = q;
+			q = t;
+		}
+		e = &edges[n_edges++];
+		e->y1 = p[0];
+		e->y2 = q[0];
+		e->x = p[1];
+		e->f = 0;
+		e->dy = (long long)q[0] - p[0];
+		dx = (long long)q[1] - p[1];
+		e->qs = dx / (long long)e->dy;
+		a = dx % (long long)e->dy;
+		if (a < 0) {	/* floor division */
+			e->qs--;
+			a += e->dy;
+		}
+		e->rs = a;
+		if (e->y2 > y_end)
+			y_end = e->y2;
+	}
+	qsort(edges, n_edges, sizeof *edges, poly_edge_cmp);
+
+	if (n_edges == 0) {
+		free(edges);
+		free(active);
+		return;
+	}
+
+	y = edges[0].y1 > bmap->clip.y1 ? edges[0].y1 : bmap->clip.y1;
+	if (y_end > bmap->clip.y2)
+		y_end = bmap->clip.y2;
+	n_active = next = 0;
+	for ( ; y < y_end; y++) {
+		uint32_t *row = bmap->data + (size_t)(y - bmap->y_origin) * bmap->w;
+
+		for (i = j = 0; i < n_active; i++)
+			if (active[i]->y2 > y)
+				active[j++] = active[i];
+		n_active = j;
+
+		/* edges starting on (or, at the first row, above) this row */
+		for ( ; next < n_edges && edges[next].y1 <= y; next++) {
+			e = &edges[next];
+			if (e->y2 <= y)
+				continue;
+			if (e->y1 < y) {	/* a < dy and rs < dy: no overflow */
+				unsigned long long ar;
+
+				a = (long long)y - e->y1;
+				ar = (unsigned long long)a * e->rs;
+				e->x += a * e->qs + (long long)(ar / e->dy);
+				e->f = ar % e->dy;
+			}
+			active[n_active++] = e;
+		}
+
+		/* sort by crossing; the order barely changes between rows */
+		for (i = 1; i < n_active; i++) {
+			e = active[i];
+			x1 = e->x + (e->f > 0);
+			for (j = i; j > 0 && active[j - 1]->x + (active[j - 1]->f > 0)
+					> x1; j--)
+				active[j] = active[j - 1];
+			active[j] = e;
+		}
+
+		/* fill from each odd crossing to the next, rounding both up */
+		for (i = 0; i + 1 < n_active; i += 2) {
+			x1 = active[i]->x + (active[i]->f > 0);
+			x2 = active[i + 1]->x + (active[i + 1]->f > 0);
+			if (x1 >= x2)
+				continue;
+			a = x2 - x1;
+			if (x1 < bmap->clip.x1)
+				x1 = bmap->clip.x1;
+			if (x2 > bmap->clip.x2)
+				x2 = bmap->clip.x2;
+			if (x1 >= x2) {
+				STAT_PIXELS(bmap, 0, a);
+				continue;
+			}
+			STAT_PIXELS(bmap, x2 - x1, a);
+			put_u32(row + x1, c, x2 - x1);
+		}
+
+		for (i = 0; i < n_active; i++) {
+			e = active[i];
+			e->x += e->qs;
+			e->f += e->rs;
+			if (e->f >= e->dy) {
+				e->f -= e->dy;
+				e->x++;
+			}
+		}
+	}
+
+	free(edges);
+	free(active);
+}
+
+void draw_fill(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *p)
+{
+	uint32_t match_colour;
+
+	if (p->x < bmap->clip.x1 || p->x >= bmap->clip.x2
+			|| p->y < bmap->clip.y1 || p->y >= bmap->clip.y2)
+		return;
+
+	match_colour = bitmap_getpixel(bmap, p->x, p->y);
+
+	/* every filled pixel has the same colour, so blend it only once */
+	if (c >> 24)
+		c = blend_px(match_colour, c);
+
+	draw_fill_scanline(bmap, c, p, match_colour);
+}
+
+/* Fills the 4-connected region of pixels within 'tolerance' (exclusive) of
+ * the colour at 'p', measured as RGB distance to that seed colour rather
+ * than between neighbours so the region can't creep along a gradient.
+ */
+void draw_smartfill(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *p, int tolerance)
+{
+	struct fill_match m;
+
+	if (p->x < bmap->clip.x1 || p->x >= bmap->clip.x2
+			|| p->y < bmap->clip.y1 || p->y >= bmap->clip.y2)
+		return;
+	if (tolerance <= 0)
+		return;
+	if (tolerance > 442)		/* > sqrt(3 * 255^2); matches everything */
+		tolerance = 442;
+
+	m.colour = bitmap_getpixel(bmap, p->x, p->y);
+	m.tol2 = tolerance * tolerance;
+	m.seen = NULL;
+
+	if ((c >> 24) || colour_dist2(c, m.colour) < m.tol2) {
+		m.seen = calloc((size_t)bmap->w * bmap->h, 1);
+		if (m.seen == NULL) {
+			fputs("ERROR: Could not allocate memory for floodfill\n",
+					stderr);
+			return;
+		}
+	}
+
+	fill_spans(bmap, c, p, &m);
+	free(m.seen);
+}
+
+/* Exact-match flood fill of the region containing 'p'
+ *
+ * pre: coordinates in p are within the clip rectangle
+ */
+static void draw_fill_scanline(const struct bitmap *bmap, uint32_t fill_colour,
+		const struct point2d *p, uint32_t match_colour)
+{
+	struct fill_match m;
+
+	if (fill_colour == match_colour)
+		return;
+
+	m.colour = match_colour;
+	m.tol2 = -1;
+	m.seen = NULL;
+	fill_spans(bmap, fill_colour, p, &m);
+}
+
+/* Row-major span fill (after Heckbert, "A Seed Fill Algorithm", Graphics
+ * Gems I). Each work item is a run of a row that borders an already
+ * filled run; the row is scanned for matching runs, which are filled with
+ * one store each and generate work for the rows above and below. Runs are
+ * found with vectorized compares and the work stack grows on demand, so
+ * the fill only stops early if memory runs out.
+ *
+ * pre: coordinates in p are within the clip rectangle; filled pixels no
+ * longer match 'm' (or are recorded in m->seen)
+ */
+static void fill_spans(const struct bitmap *bmap, uint32_t fill_colour,
+		const struct point2d *p, const struct fill_match *m)
+{
+	const int xmin = bmap->clip.x1, xmax = bmap->clip.x2 - 1;
+	const int ymin = bmap->clip.y1, ymax = bmap->clip.y2 - 1;
+	struct span_stack stack;
+	struct fill_span span;
+	uint32_t *row;
+	uint8_t *seen;
+	int x, l, r, ok = 1;
+
+#define PUSH(Y, X1, X2, DY) \
+	do { \
+		if ((Y) >= ymin && (Y) <= ymax) \
+			ok &= span_stack_push(&stack, (Y), (X1), (X2), (DY)); \
+	} while (0)
+
+	span_stack_init(&stack);
+
+	PUSH(p->y + 1, p->x, p->x, 1);
+	PUSH(p->y, p->x, p->x, -1);		/* seed, popped first */
+
+	while (ok && span_stack_pop(&stack, &span)) {
+		row = bmap->data + (size_t)(span.y - bmap->y_origin) * bmap->w;
+		seen = m->seen ? m->seen + (size_t)span.y * bmap->w : NULL;
+
+		x = span.x1;
+		if (!match_pixel(m, row, seen, x)) {
+			l = x;
+			goto skip;
+		}
+
+		l = match_left_ne(m, row, seen, x, xmin) + 1;
+		if (l < span.x1)	/* leak on left? */
+			PUSH(span.y - span.dy, l, span.x1 - 1, -span.dy);
+
+		do {
+			r = match_right_ne(m, row, seen, x, xmax + 1);
+			put_u32(row + l, fill_colour, r - l);
+			STAT_PIXELS(bmap, r - l, r - l);
+			if (seen)
+				memset(seen + l, 1, r - l);
+
+			PUSH(span.y + span.dy, l, r - 1, span.dy);
+			if (r > span.x2 + 1)	/* leak on right? */
+				PUSH(span.y - span.dy, span.x2 + 1, r - 1, -span.dy);
+			x = r;
+skip:
+			x = match_right_eq(m, row, seen, x + 1, span.x2 + 1);
+			l = x;
+		} while (x <= span.x2);
+	}
+
+#undef PUSH
+
+	if (!ok)
+		fputs("ERROR: Could not allocate memory for floodfill\n", stderr);
+	if (bmap->stats && stack.max_depth > bmap->stats->fill_max_depth)
+		bmap->stats->fill_max_depth = stack.max_depth;
+
+	span_stack_destroy(&stack);
+}
+
+
+/***************************************************************************
+ * Span stack
+ ***************************************************************************/
+
+static void span_stack_init(struct span_stack *stack)
+{
+	stack->top = NULL;
+	stack->spare = NULL;
+	stack->n = SPAN_CHUNK_SZ;
+	stack->depth = 0;
+	stack->max_depth = 0;
+}
+
+static void span_stack_destroy(struct span_stack *stack)
+{
+	struct span_chunk *chunk;
+
+	while ((chunk = stack->top) != NULL) {
+		stack->top = chunk->prev;
+		free(chunk);
+	}
+	free(stack->spare);
+}
+
+/* Returns 1 on success, 0 if the stack could not grow */
+static int span_stack_push(struct span_stack *stack, int y, int x1, int x2, int dy)
+{
+	struct fill_span *span;
+
+	if (stack->n == SPAN_CHUNK_SZ) {
+		struct span_chunk *chunk = stack->spare;
+
+		if (chunk)
+			stack->spare = NULL;
+		else if ((chunk = malloc(sizeof *chunk)) == NULL)
+			return 0;
+		chunk->prev = stack->top;
+		stack->top = chunk;
+		stack->n = 0;
+	}
+
+	span = &stack->top->spans[stack->n++];
+	span->y = y;
+	span->x1 = x1;
+	span->x2 = x2;
+	span->dy = dy;
+
+	if (++stack->depth > stack->max_depth)
+		stack->max_depth = stack->depth;
+
+	return 1;
+}
+
+static int span_stack_pop(struct span_stack *stack, struct fill_span *span)
+{
+	if (stack->depth == 0)
+		return 0;	/* stack empty */
+
+	if (stack->n == 0) {
+		struct span_chunk *chunk = stack->top;
+
+		stack->top = chunk->prev;
+		free(stack->spare);
+		stack->spare = chunk;
+		stack->n = SPAN_CHUNK_SZ;
+	}
+
+	*span = stack->top->spans[--stack->n];
+	stack->depth--;
+
+	return 1;
+}
+
+/***************************************************************************
+ * Misc
+ ***************************************************************************/
+
+/* Writes 'bmap' to 'fpo' as a P3, P6 or PAM image.
+ *
+ * Returns 0 on success, non-zero if the image could not be written.
+ */
+int bitmap_to_pbmp(FILE *fpo, const struct bitmap *bmap,
+		enum image_format format)
+{
+	if (bmap->map_len)	/* read back once, front to back */
+		madvise(bmap->data, bmap->map_len, MADV_SEQUENTIAL);
+	ppm_write_header(fpo, format, bmap->w, bmap->h);
+	if (ppm_write_rows(fpo, format, bmap->data, bmap->w, bmap->h) != 0)
+		return 1;
+	if (fflush(fpo) != 0) {
+		fputs("ERROR: Writing output image failed\n", stderr);
+		return 1;
+	}
+	return 0;
+}
+
+static double clock_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int parse_image_format(const char *s, enum image_format *format)
+{
+	if (strcmp(s, "p3") == 0 || strcmp(s, "P3") == 0)
+		*format = IMG_P3;
+	else if (strcmp(s, "p6") == 0 || strcmp(s, "P6") == 0)
+		*format = IMG_P6;
+	else if (strcmp(s, "pam") == 0 || strcmp(s, "P7") == 0)
+		*format = IMG_PAM;
+	else
+		return 0;
+	return 1;
+}
+
+/* Stores 'n' copies of 'c' starting at 'dest' */
+static void fill_u32(uint32_t *dest, uint32_t c, size_t n)
+{
+#ifdef __SSE2__
+	__m128i v = _mm_set1_epi32(c);
+
+	for ( ; n >= 16; n -= 16, dest += 16) {
+		_mm_storeu_si128((__m128i *)dest, v);
+		_mm_storeu_si128((__m128i *)(dest + 4), v);
+		_mm_storeu_si128((__m128i *)(dest + 8), v);
+		_mm_storeu_si128((__m128i *)(dest + 12), v);
+	}
+	for ( ; n >= 4; n -= 4, dest += 4)
+		_mm_storeu_si128((__m128i *)dest, v);
+#endif
+	while (n--)
+		*dest++ = c;
+}
+
+/* Draws the span centre->x - halfwidth[d - d1] .. centre->x +
+ * halfwidth[d - d1] on rows centre->y + d and centre->y - d, for d =
+ * d1..d2.
+ */
+static void draw_spans_mirrored(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *center, const int *halfwidth, int d1, int d2)
+{
+	int d;
+
+	for (d = d1; d <= d2; d++) {
+		int x1 = center->x - halfwidth[d - d1];
+		int x2 = center->x + halfwidth[d - d1];
+
+		draw_span(bmap, c, x1, x2, center->y + d);
+		if (d > 0)
+			draw_span(bmap, c, x1, x2, center->y - d);
+	}
+}
+
+/* Returns the first index in [x, end) whose pixel is not 'c', or 'end' */
+static int scan_right_ne(const uint32_t *row, int x, int end, uint32_t c)
+{
+#ifdef __SSE2__
+	__m128i v = _mm_set1_epi32(c);
+
+	for ( ; x + 4 <= end; x += 4) {
+		__m128i px = _mm_loadu_si128((const __m128i *)(row + x));
+		int m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(px, v)));
+		if (m != 0xf)
+			return x + __builtin_ctz(~m);
+	}
+#endif
+	while (x < end && row[x] == c)
+		x++;
+	return x;
+}
+
+/* Returns the last index in [start, x] whose pixel is not 'c' (searching
+ * down from 'x'), or start - 1
+ */
+static int scan_left_ne(const uint32_t *row, int x, int start, uint32_t c)
+{
+#ifdef __SSE2__
+	__m128i v = _mm_set1_epi32(c);
+
+	for ( ; x - 3 >= start; x -= 4) {
+		__m128i px = _mm_loadu_si128((const __m128i *)(row + x - 3));
+		int m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(px, v)));
+		if (m != 0xf)
+			return x - 3 + (31 - __builtin_clz(~m & 0xf));
+	}
+#endif
+	while (x >= start && row[x] == c)
+		x--;
+	return x;
+}
+
+/* Returns the first index in [x, end) whose pixel is 'c', or 'end' */
+static int scan_right_eq(const uint32_t *row, int x, int end, uint32_t c)
+{
+#ifdef __SSE2__
+	__m128i v = _mm_set1_epi32(c);
+
+	for ( ; x + 4 <= end; x += 4) {
+		__m128i px = _mm_loadu_si128((const __m128i *)(row + x));
+		int m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(px, v)));
+		if (m != 0)
+			return x + __builtin_ctz(m);
+	}
+#endif
+	while (x < end && row[x] != c)
+		x++;
+	return x;
+}
+
+/* Returns the squared RGB distance between 'a' and 'b' */
+static int colour_dist2(uint32_t a, uint32_t b)
+{
+	int dr = (int)((a >> 16) & 0xff) - (int)((b >> 16) & 0xff);
+	int dg = (int)((a >> 8) & 0xff) - (int)((b >> 8) & 0xff);
+	int db = (int)(a & 0xff) - (int)(b & 0xff);
+
+	return dr * dr + dg * dg + db * db;
+}
+
+#ifdef __SSE2__
+/* Returns a 4-bit mask of which of row[x..x+3] match 'm' (tolerance mode) */
+static int match4(const struct fill_match *m, const uint32_t *row,
+		const uint8_t *seen, int x)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+	__m128i seed = _mm_unpacklo_epi8(_mm_set1_epi32(m->colour & 0x00ffffff),
+			zero);
+	__m128i px, lo, hi, d2;
+	int32_t s;
+
+	px = _mm_and_si128(_mm_loadu_si128((const __m128i *)(row + x)), rgb);
+
+	/* widen to b,g,r,0 words, square and add pairwise: b^2+g^2, r^2 */
+	lo = _mm_sub_epi16(_mm_unpacklo_epi8(px, zero), seed);
+	hi = _mm_sub_epi16(_mm_unpackhi_epi8(px, zero), seed);
+	lo = _mm_madd_epi16(lo, lo);
+	hi = _mm_madd_epi16(hi, hi);
+	d2 = _mm_add_epi32(
+		_mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo),
+				_mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0))),
+		_mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo),
+				_mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1))));
+	d2 = _mm_cmplt_epi32(d2, _mm_set1_epi32(m->tol2));
+
+	if (seen) {
+		__m128i v;
+
+		memcpy(&s, seen + x, 4);
+		v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(s), zero);
+		v = _mm_unpacklo_epi16(v, zero);
+		d2 = _mm_andnot_si128(_mm_cmpgt_epi32(v, zero), d2);
+	}
+
+	return _mm_movemask_ps(_mm_castsi128_ps(d2));
+}
+#endif
+
+/* Returns non-zero if row[x] matches 'm' */
+static int match_pixel(const struct fill_match *m, const uint32_t *row,
+		const uint8_t *seen, int x)
+{
+	if (m->tol2 < 0)
+		return row[x] == m->colour;
+	return (seen == NULL || !seen[x])
+		&& colour_dist2(row[x], m->colour) < m->tol2;
+}
+
+/* The scan_*() functions for a fill_match */
+
+static int match_right_ne(const struct fill_match *m, const uint32_t *row,
+		const uint8_t *seen, int x, int end)
+{
+	if (m->tol2 < 0)
+		return scan_right_ne(row, x, end, m->colour);
+#ifdef __SSE2__
+	for ( ; x + 4 <= end; x += 4) {
+		int k = match4(m, row, seen, x);
+		if (k != 0xf)
+			return x + __builtin_ctz(~k);
+	}
+#endif
+	while (x < end && match_pixel(m, row, seen, x))
+		x++;
+	return x;
+}
+
+static int match_left_ne(const struct fill_match *m, const uint32_t *row,
+		const uint8_t *seen, int x, int start)
+{
+	if (m->tol2 < 0)
+		return scan_left_ne(row, x, start, m->colour);
+#ifdef __SSE2__
+	for ( ; x - 3 >= start; x -= 4) {
+		int k = match4(m, row, seen, x - 3);
+		if (k != 0xf)
+			return x - 3 + (31 - __builtin_clz(~k & 0xf));
+	}
+#endif
+	while (x >= start && match_pixel(m, row, seen, x))
+		x--;
+	return x;
+}
+
+static int match_right_eq(const struct fill_match *m, const uint32_t *row,
+		const uint8_t *seen, int x, int end)
+{
+	if (m->tol2 < 0)
+		return scan_right_eq(row, x, end, m->colour);
+#ifdef __SSE2__
+	for ( ; x + 4 <= end; x += 4) {
+		int k = match4(m, row, seen, x);
+		if (k != 0)
+			return x + __builtin_ctz(k);
+	}
+#endif
+	while (x < end && !match_pixel(m, row, seen, x))
+		x++;
+	return x;
+}
+
+static int band_ref_cmp_y(const void *a, const void *b)
+{
+	const struct band_ref *ra = a, *rb = b;
+
+	return (ra->y1 > rb->y1) - (ra->y1 < rb->y1);
+}
+
+static int band_ref_cmp_idx(const void *a, const void *b)
+{
+	const struct band_ref *ra = a, *rb = b;
+
+	return (ra->idx > rb->idx) - (ra->idx < rb->idx);
+}
+
+/* Returns the malloc()ed path "<dir>/<hash as 16 hex digits><suffix>" */
+static char *cache_path(const char *dir, uint64_t hash, const char *suffix)
+{
+	size_t len = strlen(dir) + 1 + 16 + strlen(suffix) + 1;
+	char *path;
+
+	if ((path = malloc(len)) != NULL)
+		snprintf(path, len, "%s/%016llx%s", dir,
+				(unsigned long long)hash, suffix);
+	return path;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+
+	return (va > vb) - (va < vb);
+}
+
+/* Prints a -v line about the job 'name' (NULL for the only one), with one
+ * write so the lines of concurrent jobs don't mix
+ */
+static void job_note(const char *name, const char *fmt, ...)
+{
+	char msg[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof msg, fmt, ap);
+	va_end(ap);
+	if (name)
+		fprintf(stderr, "%s: %s", name, msg);
+	else
+		fputs(msg, stderr);
+}
+
+/* Returns a fresh name for a temporary file next to 'path', to be freed
+ * by the caller, or NULL if memory ran out
+ */
+static char *temp_path(const char *path)
+{
+	static unsigned int seq;
+	size_t len = strlen(path) + 32;
+	char *tmp;
+
+	if ((tmp = malloc(len)) != NULL)
+		snprintf(tmp, len, "%s.tmp%ld.%u", path, (long)getpid(),
+				__sync_fetch_and_add(&seq, 1));
+	return tmp;
+}
+
+/* Prints a message about the input 'sb', prefixed with its name if known */
+static void script_error(const struct script_buf *sb, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (sb->name)
+		fprintf(stderr, "%s: ", sb->name);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+/* Runs jobs of the batch 'arg' until none are left */
+static void batch_worker(void *arg)
+{
+	struct batch *b = arg;
+	struct canvas_buf canvas = { NULL, 0 };
+	FILE *fpi, *fpo;
+	char *tmp;
+	size_t i;
+	int err, werr;
+
+	for (;;) {
+		pthread_mutex_lock(&b->lock);
+		i = b->next++;
+		pthread_mutex_unlock(&b->lock);
+		if (i >= b->n)
+			break;
+
+		/* the image is written under a temporary name and renamed
+		 * into place, so a failed job leaves no partial output
+		 */
+		err = 1;
+		if ((fpi = fopen(b->inputs[i], "rb")) == NULL) {
+			perror(b->inputs[i]);
+		} else if ((tmp = temp_path(b->outputs[i])) == NULL
+				|| (fpo = fopen(tmp, "wb")) == NULL) {
+			perror(tmp ? tmp : b->outputs[i]);
+			free(tmp);
+			fclose(fpi);
+		} else {
+			err = render_job(fpi, fpo, b->inputs[i], b->opts, &canvas);
+			fclose(fpi);
+			werr = ferror(fpo);
+			if (fclose(fpo) != 0 || werr) {
+				perror(b->outputs[i]);
+				err = 1;
+			}
+			if (err == 0 && rename(tmp, b->outputs[i]) != 0) {
+				perror(b->outputs[i]);
+				err = 1;
+			}
+			if (err)
+				remove(tmp);
+			free(tmp);
+		}
+
+		if (err) {
+			fprintf(stderr, "%s: job failed\n", b->inputs[i]);
+			pthread_mutex_lock(&b->lock);
+			b->failed++;
+			pthread_mutex_unlock(&b->lock);
+		}
+	}
+
+	free(canvas.data);
+}
+
+/* Takes connections off the server queue until it shuts down */
+static void *serve_worker(void *arg)
+{
+	struct server *srv = arg;
+	struct canvas_buf canvas = { NULL, 0 };
+	int fd;
+
+	for (;;) {
+		pthread_mutex_lock(&srv->lock);
+		while (srv->count == 0 && !srv->quit)
+			pthread_cond_wait(&srv->not_empty, &srv->lock);
+		if (srv->count == 0) {
+			pthread_mutex_unlock(&srv->lock);
+			break;
+		}
+		fd = srv->queue[srv->head];
+		srv->head = (srv->head + 1) % SERVE_QUEUE_SZ;
+		srv->count--;
+		pthread_cond_signal(&srv->not_full);
+		pthread_mutex_unlock(&srv->lock);
+
+		serve_handle(srv, fd, &canvas);
+	}
+
+	free(canvas.data);
+	return NULL;
+}
+
+/* Renders one connection; closes 'fd' */
+static void serve_handle(struct server *srv, int fd,
+		struct canvas_buf *canvas)
+{
+	char name[32];
+	unsigned long id;
+	double t0 = clock_seconds();
+	struct timeval tv = { SERVE_TIMEOUT_S, 0 };
+	FILE *fpi, *fpo = NULL;
+	int fd2, err = 1;
+
+	pthread_mutex_lock(&srv->lock);
+	id = ++srv->served;
+	pthread_mutex_unlock(&srv->lock);
+	snprintf(name, sizeof name, "request %lu", id);
+
+	/* a stalled client fails its job instead of holding the worker */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+	if ((fd2 = dup(fd)) < 0 || (fpi = fdopen(fd, "rb")) == NULL) {
+		perror(name);
+		close(fd);
+		if (fd2 >= 0)
+			close(fd2);
+		return;
+	}
+	if ((fpo = fdopen(fd2, "wb")) == NULL) {
+		perror(name);
+		close(fd2);
+	} else {
+		err = render_job(fpi, fpo, name, srv->opts, canvas);
+		if (fclose(fpo) != 0)
+			err = 1;
+	}
+	fclose(fpi);
+
+	if (srv->opts->verbose)
+		fprintf(stderr, "serve: %s %s in %.3f ms\n", name,
+				err ? "failed" : "done", (clock_seconds() - t0) * 1e3);
+}
+
+/* Fills in 'addr' for the Unix socket 'path'; returns non-zero (after
+ * printing a message) if the path is too long.
+ */
+static int unix_address(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr->sun_path) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return 1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/* Removes the Unix socket 'path' if there is one; returns non-zero (after
+ * printing a message) if something else is there or it can't be removed.
+ */
+static int unix_remove(const char *path)
+{
+	struct stat st;
+
+	if (lstat(path, &st) != 0) {
+		if (errno == ENOENT)
+			return 0;
+		perror(path);
+		return 1;
+	}
+	if (!S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "%s: path exists and is not a socket\n", path);
+		return 1;
+	}
+	if (unlink(path) != 0 && errno != ENOENT) {
+		perror(path);
+		return 1;
+	}
+	return 0;
+}
+
+static void serve_stop(int sig)
+{
+	(void)sig;
+	serve_stopping = 1;
+}
+
+/* Stores or, for a translucent 'c', blends 'n' copies of 'c' at 'dest' */
+static void put_u32(uint32_t *dest, uint32_t c, size_t n)
+{
+	if (c >> 24)
+		blend_u32(dest, c, n);
+	else
+		fill_u32(dest, c, n);
+}
+
+/* put_u32() for 'n' pixels 'stride' apart */
+static void put_u32_strided(uint32_t *dest, ptrdiff_t stride, uint32_t c,
+		size_t n)
+{
+	if (c >> 24) {
+		for ( ; n--; dest += stride)
+			*dest = blend_px(*dest, c);
+	} else {
+		for ( ; n--; dest += stride)
+			*dest = c;
+	}
+}
+
+/* Source-over blend of the translucent colour 'c' onto the pixel 'dest':
+ * dest + (c - dest) * alpha / 255 per channel, rounded to nearest.
+ */
+static uint32_t blend_px(uint32_t dest, uint32_t c)
+{
+	unsigned int a = 255 - (c >> 24), res = 0, t;
+	int shift;
+
+	for (shift = 0; shift < 24; shift += 8) {
+		t = ((c >> shift) & 0xff) * a + ((dest >> shift) & 0xff) * (255 - a)
+			+ 128;
+		res |= ((t + (t >> 8)) >> 8) << shift;
+	}
+	return res;
+}
+
+/* Blends 'c' onto 'n' pixels at 'dest', four at a time with the same
+ * rounding as blend_px() (the top byte of the canvas stays zero)
+ */
+static void blend_u32(uint32_t *dest, uint32_t c, size_t n)
+{
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const int a = 255 - (c >> 24);
+	__m128i src = _mm_unpacklo_epi8(_mm_set1_epi32(c & 0x00ffffff), zero);
+	__m128i sa = _mm_add_epi16(_mm_mullo_epi16(src, _mm_set1_epi16(a)),
+			_mm_set1_epi16(128));
+	__m128i ia = _mm_set1_epi16(255 - a);
+
+	for ( ; n >= 4; n -= 4, dest += 4) {
+		__m128i px = _mm_loadu_si128((const __m128i *)dest);
+		__m128i lo = _mm_unpacklo_epi8(px, zero);
+		__m128i hi = _mm_unpackhi_epi8(px, zero);
+
+		lo = _mm_add_epi16(_mm_mullo_epi16(lo, ia), sa);
+		hi = _mm_add_epi16(_mm_mullo_epi16(hi, ia), sa);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		_mm_storeu_si128((__m128i *)dest, _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for ( ; n--; dest++)
+		*dest = blend_px(*dest, c);
+}
+
+/* The y of the first octant circle point in column x: the largest y with
+ * y * (y - 1) < r2 - x * x
+ */
+static long long circle_y(long long r2, long long x)
+{
+	long long d = r2 - x * x;
+	long long y = (long long)(0.5 + sqrt((double)d + 0.25));
+
+	while (y > 0 && y * (y - 1) >= d)
+		y--;
+	while ((y + 1) * y < d)
+		y++;
+	return y;
+}
+
+/* The last x of the first octant of a circle: x - circle_y(x) only grows */
+static long long circle_xend(long long r2, int radius)
+{
+	long long lo = 0, hi = radius, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (mid <= circle_y(r2, mid))
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/* Draws one octant of a circle: the points (x, circle_y(x)) for x in
+ * 1..xend, swapped to (circle_y(x), x) if bit 2 of 'oct' is set (minus
+ * the diagonal, which the unswapped octant draws) and mirrored in the
+ * centre column and row by bits 0 and 1. Only the range of x whose points
+ * are inside the clip rectangle is visited; circle_y() is monotonic, so
+ * that range is found by bisection.
+ */
+static void circle_arc(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *center, long long r2, long long xend, int oct)
+{
+	const int sx = oct & 1 ? -1 : 1, sy = oct & 2 ? -1 : 1;
+	const int swap = oct & 4;
+	long long umin, umax, vmin, vmax;	/* visible offsets from the centre */
+	long long tmin, tmax, ymin, ymax;	/* ... for x and circle_y(x) */
+	long long lo, hi, mid, t, y, total;
+	uint32_t *dest;
+
+	total = xend;
+	if (swap && circle_y(r2, xend) == xend)
+		total--;
+
+	if (!clip_range(bmap->clip.x1, bmap->clip.x2, center->x, sx, &umin, &umax)
+			|| !clip_range(bmap->clip.y1, bmap->clip.y2, center->y, sy,
+				&vmin, &vmax)) {
+		STAT_PIXELS(bmap, 0, total);
+		return;
+	}
+	if (swap) {
+		tmin = vmin;
+		tmax = vmax;
+		ymin = umin;
+		ymax = umax;
+	} else {
+		tmin = umin;
+		tmax = umax;
+		ymin = vmin;
+		ymax = vmax;
+	}
+	if (tmin < 1)
+		tmin = 1;
+	if (tmax > total)
+		tmax = total;
+
+	/* first x with circle_y(x) <= ymax */
+	lo = tmin;
+	hi = tmax + 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (circle_y(r2, mid) <= ymax)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	tmin = lo;
+
+	/* last x with circle_y(x) >= ymin */
+	lo = tmin - 1;
+	hi = tmax;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (circle_y(r2, mid) >= ymin)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	tmax = lo;
+
+	if (tmin > tmax) {
+		STAT_PIXELS(bmap, 0, total);
+		return;
+	}
+	STAT_PIXELS(bmap, tmax - tmin + 1, total);
+
+	y = circle_y(r2, tmin);
+	for (t = tmin; t <= tmax; t++) {
+		while (y * (y - 1) >= r2 - t * t)
+			y--;
+		if (swap)
+			dest = bmap->data + (center->x + sx * y)
+				+ (size_t)(center->y + sy * t - bmap->y_origin) * bmap->w;
+		else
+			dest = bmap->data + (center->x + sx * t)
+				+ (size_t)(center->y + sy * y - bmap->y_origin) * bmap->w;
+		*dest = c >> 24 ? blend_px(*dest, c) : c;
+	}
+}
+
+/* Sets [*min, *max] to the offsets d >= 0 for which centre + sign * d lies
+ * in [lo, hi). Returns 0 if there are none.
+ */
+static int clip_range(int lo, int hi, int centre, int sign,
+		long long *min, long long *max)
+{
+	if (sign > 0) {
+		*min = (long long)lo - centre;
+		*max = (long long)hi - 1 - centre;
+	} else {
+		*min = (long long)centre - (hi - 1);
+		*max = (long long)centre - lo;
+	}
+	if (*min < 0)
+		*min = 0;
+	return *min <= *max;
+}
+
+/* Orders polygon edges by their first row */
+static int poly_edge_cmp(const void *a, const void *b)
+{
+	const struct poly_edge *ea = a, *eb = b;
+
+	return (ea->y1 > eb->y1) - (ea->y1 < eb->y1);
+}
+
+/* Sets [*d1, *d2] to the offsets 0..radius of the rows centre + d and
+ * centre - d that may lie in [lo, hi). Returns 0 if there are none.
+ */
+static int mirrored_rows(int lo, int hi, int centre, int radius,
+		int *d1, int *d2)
+{
+	long long min1, max1, min2, max2;
+	int down = clip_range(lo, hi, centre, 1, &min1, &max1);
+	int up = clip_range(lo, hi, centre, -1, &min2, &max2);
+
+	if (!down && !up)
+		return 0;
+	if (!down || (up && min2 < min1))
+		min1 = min2;
+	if (!down || (up && max2 > max1))
+		max1 = max2;
+	if (max1 > radius)
+		max1 = radius;
+	if (min1 > max1)
+		return 0;
+	*d1 = min1;
+	*d2 = max1;
+	return 1;
+}
+
+/* floor(sqrt(n)) for n >= 0 */
+static long long isqrt_ll(long long n)
+{
+	long long t = (long long)sqrt((double)n);
+
+	while (t > 0 && t * t > n)
+		t--;
+	while ((t + 1) * (t + 1) <= n)
+		t++;
+	return t;
+}
+
+/* Returns the half-widths of rows d1..d2 (0 <= d1 <= d2 <= radius) of a
+ * filled circle, counted from the centre row outwards (see
+ * draw_fcircle()), or NULL if memory ran out. The caller frees the array.
+ *
+ * Up to the end of the first octant the outermost pixel of row d is the
+ * swapped octant's (circle_y(d), d); below it, it is the last x with
+ * circle_y(x) >= d, i.e. with x^2 < r^2 - d * (d - 1).
+ */
+static int *fcircle_rows(int radius, int d1, int d2)
+{
+	long long r2 = (long long)radius * radius, xend, d;
+	int *hw;
+
+	if ((hw = malloc(((size_t)d2 - d1 + 1) * sizeof *hw)) == NULL) {
+		fputs("ERROR: Could not allocate rows for filled circle\n", stderr);
+		return NULL;
+	}
+
+	xend = circle_xend(r2, radius);
+	for (d = d1; d <= d2; d++) {
+		if (d <= xend)
+			hw[d - d1] = circle_y(r2, d);
+		else
+			hw[d - d1] = isqrt_ll(r2 - d * (d - 1) - 1);
+	}
+
+	return hw;
+}
+
+/* The x of the first point on row y (0 <= y <= radius2) of the arc that
+ * draw_ellipse() steps along, or a positive value if the arc reaches the
+ * centre column before that row.
+ *
+ * With F(x, y) = b2 x^2 + a2 y^2 - a2 b2, a step from (x, y - 1) goes down
+ * a row if F(x + 1, y - 1) + F(x + 1, y) <= 0 and also right if F(x, y) +
+ * F(x + 1, y) >= 0, and otherwise always goes right. So the arc leaves row
+ * y - 1 at the first x, from where it entered that row, for which the
+ * first test holds. That x has a closed form, and the arc only needs to be
+ * followed from row y - 1.
+ */
+static long ellipse_row_x(conic_t a2, conic_t b2, int radius1, long y)
+{
+	long x = -radius1, xs, v;
+	long long u;
+	conic_t k;
+
+	for (v = y > 1 ? y - 1 : 1; v <= y; v++) {
+		/* leftmost x in [-radius1, -1] with 2 b2 (x + 1)^2 <= k */
+		k = a2 * (2 * b2 - (conic_t)v * v - (conic_t)(v - 1) * (v - 1));
+		if (k < 0) {
+			xs = 0;
+		} else {
+			u = isqrt_ll((long long)(k / (2 * b2)));
+			xs = -u - 1 < -radius1 ? -radius1 : -u - 1;
+		}
+		if (xs < x)
+			xs = x;		/* the arc entered row v further right */
+
+		x = xs;
+		if (b2 * ((conic_t)(xs + 1) * (xs + 1) + (conic_t)xs * xs)
+				+ 2 * a2 * v * v - 2 * a2 * b2 >= 0)
+			x++;
+	}
+
+	return x;
+}
+
+/* Whether the arc of draw_ellipse(), at the point (x, y - 1), steps down to
+ * row y (see ellipse_row_x())
+ */
+static int ellipse_steps_down(conic_t a2, conic_t b2, long x, long y)
+{
+	return 2 * b2 * ((conic_t)(x + 1) * (x + 1))
+		<= a2 * (2 * b2 - (conic_t)y * y - (conic_t)(y - 1) * (y - 1));
+}
+
+/* fcircle_rows() for an ellipse: rows d1..d2 of radius2 + 1 */
+static int *fellipse_rows(int radius1, int radius2, int d1, int d2)
+{
+	conic_t a2 = (conic_t)radius1 * radius1, b2 = (conic_t)radius2 * radius2;
+	long x;
+	int d, *hw;
+
+	if (radius1 > CONIC_RADIUS_MAX || radius2 > CONIC_RADIUS_MAX) {
+		fputs("ERROR: Ellipse radii too large to draw\n", stderr);
+		return NULL;
+	}
+	if ((hw = malloc(((size_t)d2 - d1 + 1) * sizeof *hw)) == NULL) {
+		fputs("ERROR: Could not allocate rows for filled ellipse\n", stderr);
+		return NULL;
+	}
+
+	for (d = d1; d <= d2; d++) {
+		x = ellipse_row_x(a2, b2, radius1, d);
+		hw[d - d1] = x < 0 ? -x : 0;
+	}
+
+	return hw;
+}
@@ -0,0 +1,124 @@
+#ifndef PBMPGFX_H
+#define PBMPGFX_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ppm.h"
+
+/* libpbmpgfx: the renderer behind the pbmpgfx command, for use in-process.
+ *
+ * A canvas is a struct bitmap: 'w' * 'h' pixels in row-major order, packed
+ * 0x00RRGGBB, which callers may read and write directly. Colours passed to
+ * the drawing functions are packed by fromRGB() or fromRGBA(). Errors are
+ * reported as messages on stderr.
+ *
+ * A canvas may be drawn to from one thread at a time; separate canvases
+ * are independent.
+ */
+
+/* Tiled rendering (render_opts.threads > 1): tile edge length in pixels */
+#define TILE_SZ            64
+
+/* Rectangle with exclusive right/bottom edges */
+struct rect {
+	int x1, y1, x2, y2;
+};
+
+struct render_stats;
+
+/* Drawing primitives only touch pixels inside 'clip', which is normally the
+ * whole canvas. Several bitmaps may share 'data' with disjoint clip
+ * rectangles (see render_tiled()). 'data' holds the rows from 'y_origin'
+ * on, which is 0 except for the band views of render_banded(), so pixel
+ * (x, y) is data[x + (y - y_origin) * w]. Coordinates are ints, but pixel
+ * offsets are computed in size_t so w * h may exceed 2^31.
+ */
+struct bitmap {
+	int w, h;
+	uint32_t *data;
+	int y_origin;
+	struct rect clip;
+	size_t map_len;		/* non-zero if 'data' is a mapping */
+	struct render_stats *stats;	/* counters to update, or NULL */
+};
+
+struct rgb255 {
+	int r, g, b;
+};
+
+struct point2d {
+	int x, y;
+};
+
+struct render_opts {
+	enum image_format format;
+	int compile;		/* write a display list instead of an image */
+	int threads;		/* > 1 renders tiles in parallel */
+	int verbose;
+	const char *canvas_file;	/* back the canvas with this new file */
+	int band_rows;		/* > 0 streams the image in bands */
+	const char *cache_dir;	/* checkpoint directory, or NULL */
+	int stats;		/* collect and report render_stats */
+	const char *stats_file;	/* write them as JSON here, else stderr */
+	int cull;		/* drop overdrawn commands before rendering */
+};
+
+/***************************************************************************/
+
+void render_opts_init(struct render_opts *opts);
+
+int parse_file(FILE *fpi, FILE *fpo, const struct render_opts *opts);
+struct bitmap *script_render(const char *data, size_t len,
+		const struct render_opts *opts);
+struct bitmap *script_render_file(FILE *fp, const struct render_opts *opts);
+
+int batch_run(const char *manifest, const struct render_opts *opts);
+
+int serve(const char *path, const struct render_opts *opts);
+int serve_connect(const char *path);
+
+uint32_t fromRGB(const struct rgb255 *c);
+uint32_t fromRGBA(const struct rgb255 *c, int alpha);
+void toRGB(uint32_t c, struct rgb255 *dest);
+
+struct bitmap *bitmap_new(int w, int h);
+void bitmap_destroy(struct bitmap *bmap);
+void bitmap_setpixel(const struct bitmap *bmap, uint32_t c,
+		int x, int y);
+uint32_t bitmap_getpixel(const struct bitmap *bmap, int x, int y);
+int bitmap_to_pbmp(FILE *fpo, const struct bitmap *bmap,
+		enum image_format format);
+
+void draw_point(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *p);
+void draw_point_xy(const struct bitmap *bmap, uint32_t c,
+		int x, int y);
+void draw_line(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *p1, const struct point2d *p2);
+void draw_span(const struct bitmap *bmap, uint32_t c, int x1, int x2, int y);
+void draw_rect(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *p1, const struct point2d *p2);
+void draw_circle(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *center, int radius);
+void draw_ellipse(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *center,
+		int radius1, int radius2);
+void draw_fcircle(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *center, int radius);
+void draw_fellipse(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *center,
+		int radius1, int radius2);
+void draw_polyline(const struct bitmap *bmap, uint32_t c, const int *v,
+		int n);
+void draw_polygon(const struct bitmap *bmap, uint32_t c, const int *v,
+		int n);
+void draw_fill(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *p);
+void draw_smartfill(const struct bitmap *bmap, uint32_t c,
+		const struct point2d *p, int tolerance);
+
+int parse_image_format(const char *s, enum image_format *format);
+
+#endif /* PBMPGFX_H */
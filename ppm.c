@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ppm.h"
+
+/* Size of the block that encoded rows are assembled in before being handed
+ * to fwrite(). Must be larger than the biggest encoded pixel (15 bytes).
+ */
+#define PPM_BLOCK_SZ (256 * 1024)
+
+/* "%-3u " for every possible component value, 4 bytes per entry. Each P3
+ * pixel is three entries followed by three more spaces, which reproduces
+ * fprintf("%-3u %-3u %-3u    ") exactly.
+ */
+static const char p3_digits[256 * 4 + 1] =
+	"0   1   2   3   4   5   6   7   8   9   10  11  12  13  14  15  "
+	"16  17  18  19  20  21  22  23  24  25  26  27  28  29  30  31  "
+	"32  33  34  35  36  37  38  39  40  41  42  43  44  45  46  47  "
+	"48  49  50  51  52  53  54  55  56  57  58  59  60  61  62  63  "
+	"64  65  66  67  68  69  70  71  72  73  74  75  76  77  78  79  "
+	"80  81  82  83  84  85  86  87  88  89  90  91  92  93  94  95  "
+	"96  97  98  99  100 101 102 103 104 105 106 107 108 109 110 111 "
+	"112 113 114 115 116 117 118 119 120 121 122 123 124 125 126 127 "
+	"128 129 130 131 132 133 134 135 136 137 138 139 140 141 142 143 "
+	"144 145 146 147 148 149 150 151 152 153 154 155 156 157 158 159 "
+	"160 161 162 163 164 165 166 167 168 169 170 171 172 173 174 175 "
+	"176 177 178 179 180 181 182 183 184 185 186 187 188 189 190 191 "
+	"192 193 194 195 196 197 198 199 200 201 202 203 204 205 206 207 "
+	"208 209 210 211 212 213 214 215 216 217 218 219 220 221 222 223 "
+	"224 225 226 227 228 229 230 231 232 233 234 235 236 237 238 239 "
+	"240 241 242 243 244 245 246 247 248 249 250 251 252 253 254 255 ";
+
+static int ppm_flush(FILE *fpo, const char *buff, size_t len);
+
+/***************************************************************************/
+
+void ppm_write_header(FILE *fpo, enum image_format format, long w, long h)
+{
+	switch (format) {
+	case IMG_P6:
+		fprintf(fpo, "P6\n%ld %ld\n255\n", w, h);
+		break;
+	case IMG_PAM:
+		fprintf(fpo, "P7\nWIDTH %ld\nHEIGHT %ld\nDEPTH 3\nMAXVAL 255\n"
+				"TUPLTYPE RGB\nENDHDR\n", w, h);
+		break;
+	case IMG_P3:
+	default:
+		fprintf(fpo, "P3 %ld %ld\n255\n", w, h); /* PBMP header */
+		break;
+	}
+}
+
+/* Encodes 'rows' rows of 'w' pixels each, starting at 'data', and appends
+ * them to 'fpo'. Rows are assembled into large blocks so that the number of
+ * stdio calls is independent of the number of pixels.
+ *
+ * Returns 0 on success, -1 on allocation or write failure.
+ */
+int ppm_write_rows(FILE *fpo, enum image_format format,
+		const uint32_t *data, size_t w, size_t rows)
+{
+	char *buff, *d, *end;
+	const uint32_t *src = data;
+	size_t row, col;
+	int err = 0;
+
+	if ((buff = malloc(PPM_BLOCK_SZ)) == NULL) {
+		fputs("ERROR: Could not allocate output buffer\n", stderr);
+		return -1;
+	}
+
+	d = buff;
+	end = buff + PPM_BLOCK_SZ;
+
+	for (row = 0; row < rows && err == 0; row++) {
+		if (format == IMG_P3) {
+			for (col = 0; col < w; col++) {
+				uint32_t c = *src++;
+
+				if (end - d < 16) {
+					err = ppm_flush(fpo, buff, d - buff);
+					d = buff;
+				}
+				memcpy(d,      p3_digits + 4 * ((c >> 16) & 0xff), 4);
+				memcpy(d + 4,  p3_digits + 4 * ((c >> 8) & 0xff), 4);
+				memcpy(d + 8,  p3_digits + 4 * (c & 0xff), 4);
+				memcpy(d + 12, "   ", 3);
+				d += 15;
+			}
+			if (d == end) {
+				err = ppm_flush(fpo, buff, d - buff);
+				d = buff;
+			}
+			*d++ = '\n';
+		} else {
+			for (col = 0; col < w; col++) {
+				uint32_t c = *src++;
+
+				if (end - d < 3) {
+					err = ppm_flush(fpo, buff, d - buff);
+					d = buff;
+				}
+				d[0] = c >> 16;
+				d[1] = c >> 8;
+				d[2] = c;
+				d += 3;
+			}
+		}
+	}
+
+	if (err == 0)
+		err = ppm_flush(fpo, buff, d - buff);
+
+	free(buff);
+
+	return err;
+}
+
+/***************************************************************************
+ * Helpers
+ ***************************************************************************/
+
+static int ppm_flush(FILE *fpo, const char *buff, size_t len)
+{
+	if (len && fwrite(buff, 1, len, fpo) != len) {
+		fputs("ERROR: Writing output image failed\n", stderr);
+		return -1;
+	}
+	return 0;
+}
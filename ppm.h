@@ -0,0 +1,21 @@
+#ifndef PPM_H
+#define PPM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Output image encoders shared by the renderer (bitmap.c) and the edge
+ * detector (edge.c). Pixels are packed 0x00RRGGBB as produced by fromRGB().
+ */
+
+enum image_format {
+	IMG_P3, IMG_P6, IMG_PAM
+};
+
+void ppm_write_header(FILE *fpo, enum image_format format,
+		long w, long h);
+int ppm_write_rows(FILE *fpo, enum image_format format,
+		const uint32_t *data, size_t w, size_t rows);
+
+#endif /* PPM_H */
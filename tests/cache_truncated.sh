@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# --cache: a truncated checkpoint must be ignored. The script is translucent,
+# so any pixels read from the checkpoint before the render starts over would
+# be blended twice and change the image.
+#
+# Usage: cache_truncated.sh PBMPGFX
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 PBMPGFX" >&2
+	exit 1
+fi
+
+pbmpgfx=$1
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT INT TERM
+
+mkdir "$tmp/cache"
+printf '8 8\nrect 255 0 0 128 0 0 8 8\n' > "$tmp/scene.txt"
+
+"$pbmpgfx" < "$tmp/scene.txt" > "$tmp/ref.ppm" || exit 1
+"$pbmpgfx" -C "$tmp/cache" < "$tmp/scene.txt" > "$tmp/first.ppm" || exit 1
+cmp -s "$tmp/ref.ppm" "$tmp/first.ppm" || {
+	echo "FAIL: first render with --cache differs" >&2
+	exit 1
+}
+
+# keep the 32 byte header and half of the 8x8 pixels
+set -- "$tmp"/cache/*.pbck
+if [ ! -f "$1" ]; then
+	echo "FAIL: no checkpoint written" >&2
+	exit 1
+fi
+head -c 160 "$1" > "$tmp/part" && mv "$tmp/part" "$1"
+
+"$pbmpgfx" -C "$tmp/cache" < "$tmp/scene.txt" > "$tmp/second.ppm" || exit 1
+cmp -s "$tmp/ref.ppm" "$tmp/second.ppm" || {
+	echo "FAIL: render from a truncated checkpoint differs" >&2
+	exit 1
+}
+echo "ok"